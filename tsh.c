@@ -3,6 +3,7 @@
  * 
  * <Put your name and login ID here>
  */
+#define _GNU_SOURCE         /* O_PATH and the other Linux interfaces below */
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,18 +16,42 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/pidfd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <sched.h>
 
 /* Misc manifest constants */
 #define MAXLINE    1024   /* max line size */
 #define MAXARGS     128   /* max args on a command line */
-#define MAXJOBS      16   /* max jobs at any point in time */
-#define MAXJID    1<<16   /* max job ID */
+#define MAXSTAGES    16   /* max commands in a pipeline */
+#define MAXJOBS      16   /* default max jobs at any point in time */
+#define MAXJID  (1<<16)   /* max job ID */
+#define JIDWORDS (MAXJID / 64)  /* words in the JID bitmap */
+#define JOBSLAB      64   /* job records per slab (one bit each in a word) */
+#define JOBIDX_BITS   5   /* log2 of the initial PID/JID index size */
+#define ARENACHUNK (64<<10) /* bytes the string arena grabs at a time */
+#define ARENACLASSES 10   /* arena size classes: 16, 32, ..., 8192 bytes */
+#define CMDHASH_BITS  6   /* log2 of the initial command hash size */
+#define BATCHBLOCK (64<<10) /* bytes read at a time from a script */
+#define MAXREPORTS   16   /* finished `time` jobs waiting to be printed */
 
 /* Job states */
 #define UNDEF         0   /* undefined */
 #define FG            1   /* running in foreground */
 #define BG            2   /* running in background */
 #define ST            3   /* stopped */
+#define QUEUED        4   /* waiting for a background slot (setmax) */
 
 /* 
  * Jobs states: FG (foreground), BG (background), ST (stopped)
@@ -35,9 +60,19 @@
  *     ST -> FG  : fg command
  *     ST -> BG  : bg command
  *     BG -> FG  : fg command
+ *     QUEUED -> BG : a background job was reaped or stopped (setmax)
+ *     QUEUED -> FG : fg command
  * At most 1 job can be in the FG state.
  */
 
+/* Launch engines (-e) */
+#define LAUNCH_FORK   0   /* fork + setpgid + dup2 + execve (default) */
+#define LAUNCH_SPAWN  1   /* posix_spawn with attributes and file actions */
+
+#ifndef PIDFD_SIGNAL_PROCESS_GROUP
+#define PIDFD_SIGNAL_PROCESS_GROUP (1 << 2) /* signal the process group (Linux 6.9) */
+#endif
+
 /* Parsing states */
 #define ST_NORMAL   0x0   /* next token is an argument */
 #define ST_INFILE   0x1   /* next token is the input file */
@@ -47,23 +82,319 @@
 extern char **environ;      /* defined in libc */
 char prompt[] = "tsh> ";    /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;            /* if true, print additional output */
-int nextjid = 1;            /* next job ID to allocate */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
-int pipe_fd[2];             /* 管道的文件描述符 */
+int launch_engine = LAUNCH_FORK; /* how external commands are started */
+int event_mode = 0;         /* if true, signals are read from sig_fd (-E) */
+int sig_fd = -1;            /* signalfd for SIGCHLD, SIGINT and SIGTSTP */
+int epoll_fd = -1;          /* everything wait_event waits for, except stdin */
+sigset_t child_mask;        /* signal mask the shell started with */
+int untracked = 0;          /* live children without a pidfd */
+
+/*
+ * 控制socket（-S）：一个AF_UNIX流socket，在事件循环里处理。每个连接
+ * 一行一个请求，回一行JSON。回复写不进去（对方不读）就断开它，
+ * 不会让shell阻塞。
+ */
+#define CTLCLIENTS 16       /* max connected clients */
+#define LISTENQ 16          /* listen backlog */
+struct ctlclient_t {
+    int fd;                 /* -1 if the slot is free */
+    int len;                /* bytes in in[] */
+    char in[MAXLINE];       /* partial request */
+};
+struct ctlclient_t ctl_clients[CTLCLIENTS];
+char *ctl_path = NULL;      /* socket path (-S) */
+int ctl_fd = -1;            /* listening socket */
+int ctl_idle = 0;           /* waiting at the prompt: fg is allowed */
+
+/* limit前缀设置的资源限制，0表示不限制 */
+struct joblimit_t {
+    rlim_t mem;             /* RLIMIT_AS, bytes */
+    rlim_t cpu;             /* RLIMIT_CPU, seconds */
+    rlim_t files;           /* RLIMIT_NOFILE */
+};
+
+/*
+ * 命令前面的前缀：time、cpus LIST、nice N和limit mem=.. cpu=.. files=..，
+ * 顺序随意。cpus、nice和limit在子进程里setpgid以后、execve之前设置，
+ * 不用再多exec一次taskset、nice或者prlimit。
+ */
+struct jobprefix_t {
+    int timed;              /* time: print resource usage when done */
+    int pinned;             /* cpus given */
+    cpu_set_t cpus;         /* CPUs the job may run on */
+    char *cpulist;          /* cpus argument as typed (parseline's buffer) */
+    int niced;              /* nice given */
+    int nice;               /* nice value, -20..19 */
+    int limited;            /* limit given */
+    struct joblimit_t lim;
+};
+
+/*
+ * 排队作业的启动参数，整个放在字符串arena的一块里。命令名在入队的时候
+ * 就解析好了，出队时（可能在sigchld_handler里）只需要_Fork和execve。
+ */
+struct launchspec_t {
+    struct jobprefix_t pre; /* cpus and nice to apply (cpulist unused) */
+    int nstages;            /* commands in the pipeline */
+    char *infile;           /* input of the first command, or NULL */
+    char *outfile;          /* output of the last command, or NULL */
+    char *cmdline;          /* for the notice printed when it starts */
+    char *path[MAXSTAGES];  /* resolved program of each command */
+    char **argv[MAXSTAGES]; /* NULL-terminated arguments of each command */
+};
+
+/*
+ * wait命令等的作业结束的时候，freejob把它的JID、PID和结束状态填到这里
+ * （可能在信号处理程序里）；status是-1表示还没结束。
+ */
+struct waitres_t {
+    int jid;
+    pid_t pid;
+    int status;             /* wait status, -1 while still waiting */
+};
+
+/*
+ * 作业的冷数据：记账和前缀，只有jobs -l、time、limit和统计会用到。
+ * 和命令行一样放在字符串arena里，job_t里只留一个指针，这样job_t
+ * 正好一个cache line，遍历作业表的时候不会把这些也带进来。
+ */
+struct jobinfo_t {
+    struct timespec start;  /* submission time, CLOCK_MONOTONIC */
+    struct timespec changed; /* time of the last state change */
+    struct timespec launched; /* when eval/start_job released it */
+    int heard;              /* got a SIGCHLD from it already */
+    int stops;              /* number of stop/continue cycles */
+    struct rusage ru;       /* usage of the processes reaped so far */
+    struct jobprefix_t pre; /* its prefixes; pre.cpulist is in the arena */
+};
 
 struct job_t {              /* The job struct */
-    pid_t pid;              /* job PID */
+    pid_t pid;              /* job PID (process group of every stage) */
     int jid;                /* job ID [1, 2, ...] */
     int state;              /* UNDEF, BG, FG, or ST */
-    char cmdline[MAXLINE];  /* command line */
+    int nprocs;             /* processes not reaped yet */
+    pid_t lastpid;          /* PID of the last pipeline stage */
+    int status;             /* wait status of the last stage */
+    struct jobinfo_t *info; /* accounting and prefixes, in the string arena */
+    struct launchspec_t *spec; /* what to start, while QUEUED */
+    struct job_t *qnext;    /* next job in the queue */
+    struct waitres_t *waiter; /* where `wait` wants the exit status */
+    char *cmdline;          /* command line, lives in the string arena */
+};
+
+/*
+ * 命令行字符串的arena：从大块内存里bump分配，按2的幂分成几个大小类，
+ * 释放的块挂到对应大小类的空闲链表上，下次同样大小的分配直接复用。
+ * 和作业表一样，只有主程序（屏蔽信号时）会分配；deletejob在
+ * sigchld_handler里释放时只是把块压回链表，是异步信号安全的。
+ */
+struct arenablk_t {
+    int cls;                /* size class of the block */
+    struct arenablk_t *next;/* next free block of the same class */
+};
+struct arena_t {
+    char *bump;             /* next free byte in the current chunk */
+    char *end;              /* end of the current chunk */
+    struct arenablk_t *free[ARENACLASSES]; /* free lists by size class */
+};
+struct arena_t str_arena;   /* The string arena */
+
+/*
+ * PATH查找的缓存：命令名 -> 解析出来的路径，和作业索引一样是开放定址的。
+ * 每个PATH目录保存一个O_PATH的fd和上次看到的mtime，命中的时候只要
+ * fstat一下从第一个目录到命中目录的这几个fd，有目录变了（比如装了新命令，
+ * 可能把后面目录里的同名命令遮住）就整个清空重新查找。
+ */
+struct pathdir_t {
+    char *dir;              /* directory name */
+    int fd;                 /* O_PATH descriptor of the directory, -1 if missing */
+    struct timespec mtime;  /* mtime when the cache was filled */
+};
+struct cmdent_t {
+    char *name;             /* command name as typed */
+    char *path;             /* resolved path */
+    int dir;                /* index of the PATH directory it was found in */
+    int hits;               /* times the entry was used */
+};
+struct cmdcache_t {
+    char *path;             /* copy of $PATH the directories came from */
+    struct pathdir_t *dirs; /* one per PATH element */
+    int ndirs;
+    struct cmdent_t **ent;  /* 1 << bits entries, NULL if empty */
+    int bits;
+    int count;
+};
+struct cmdcache_t cmd_cache; /* The command hash */
+
+/*
+ * 批处理模式（-c或者脚本文件）的输入：一次读BATCHBLOCK字节，就地切成
+ * 行放进队列，队列空了才读下一块，所以行指针在被取走之前一直有效。
+ */
+struct batch_t {
+    int active;             /* reading from a script or -c string */
+    int fd;                 /* script file, -1 for -c */
+    int eof;                /* nothing more to read */
+    char *buf;              /* current block, lines split in place */
+    size_t len, cap;        /* bytes in buf, size of buf */
+    size_t off;             /* start of the unfinished last line */
+    char **line;            /* queue of complete lines in buf */
+    int head, count, size;  /* next line, lines queued, queue capacity */
+};
+struct batch_t batch;       /* The script being run */
+
+/*
+ * `time`作业结束的时候，回收它的人（可能是信号处理程序）在这里填一条
+ * 记录，主程序在屏蔽SIGCHLD的情况下取出来用printf打印。
+ */
+struct timereport_t {
+    int jid;
+    pid_t pid;
+    struct timespec real;   /* wall clock time from submission to reap */
+    struct rusage ru;       /* summed over every process of the job */
+};
+struct timereport_t time_reports[MAXREPORTS];
+volatile int nreports = 0;
+volatile sig_atomic_t interrupted = 0; /* ctrl-c with no foreground job */
+
+/*
+ * 作业结束或者停止的通知，还有排队的后台作业启动的通知。child_changed
+ * （可能在sigchld_handler里）只往环里写一条定长记录，主程序在wait_event返回以后、打印提示符之前把它们
+ * 格式化，攒起来一次write。只有一个生产者（屏蔽了所有信号的
+ * child_changed）和一个消费者（主程序），所以不用锁：生产者只写tail，
+ * 消费者只写head，用release/acquire保证先看到记录再看到下标。
+ */
+#define NOTICES     1024  /* ring size, a power of 2 */
+#define NOTICE_TERM    0  /* terminated by signal sig */
+#define NOTICE_STOP    1  /* stopped by signal sig */
+#define NOTICE_START   2  /* queued job started in the background */
+#define NOTICE_CPULIMIT 0x1 /* flag: killed by its limit cpu= */
+#define NOTICE_MAX (MAXLINE + 128) /* longest formatted notice */
+struct notice_t {
+    short kind;             /* NOTICE_TERM, NOTICE_STOP or NOTICE_START */
+    short flags;
+    int sig;
+    int jid;
+    pid_t pid;
+    long t_ns;              /* CLOCK_MONOTONIC when it was queued */
+    struct launchspec_t *spec; /* NOTICE_START: the job's spec, freed once printed */
+};
+struct notice_t notices[NOTICES];
+unsigned notice_head = 0;   /* next record to print, written by the consumer */
+unsigned notice_tail = 0;   /* next free record, written by the producer */
+volatile sig_atomic_t flushing = 0; /* flush_notices is running */
+
+/*
+ * 一直开着的计数器和延迟直方图，stats命令打印。直方图按2的幂分桶：第i个
+ * 桶是[2^i, 2^(i+1))纳秒。信号处理程序和主程序都会更新，所以都用原子
+ * 加法，每次只是一次clock_gettime（vDSO）加几次原子加法。
+ */
+#define HISTBUCKETS 64
+struct hist_t {
+    const char *name;
+    unsigned long count;
+    unsigned long sum;      /* ns */
+    unsigned long max;      /* ns */
+    unsigned long bucket[HISTBUCKETS];
+};
+enum { H_PARSE,     /* eval: parseline + prefixes */
+       H_LAUNCH,    /* first fork to releasing the job to the handlers */
+       H_FIRSTCHLD, /* release to the first SIGCHLD of the job */
+       H_RELAY,     /* relaying ctrl-c/ctrl-z to the foreground job */
+       H_NOTICE,    /* child_changed queueing a notice to printing it */
+       NHISTS };
+struct hist_t hists[NHISTS] = {
+    {"parse"}, {"launch"}, {"first_sigchld"}, {"relay"}, {"notice"}
+};
+enum { C_JOBS, C_PROCS, C_REAPED, C_STOPS, C_CONTS, C_SIGNALS, C_QUEUED, NCOUNTERS };
+const char *counter_names[NCOUNTERS] = {
+    "jobs", "processes", "reaped", "stops", "continues", "signals", "queued"
+};
+unsigned long counters[NCOUNTERS];
+
+/*
+ * 作业生命周期日志（-L）：每个事件一行JSON，带CLOCK_MONOTONIC时间戳。
+ * 记录先用sio_format拼好，再原子地在当前缓冲区里占一段位置复制进去，
+ * 信号处理程序和主程序都可以写，不用屏蔽信号。log_word的最高位是当前
+ * 缓冲区的编号，低31位是已经占用的长度；主程序flush_log的时候原子地
+ * 换到另一个缓冲区，再把换下来的那个整块写到文件里。
+ */
+#define LOGBUF      (64 << 10)  /* bytes per log buffer */
+#define LOGCUR      (1u << 31)  /* log_word: which buffer is current */
+int log_fd = -1;            /* -L file, -1 if not logging */
+char *log_bufs[2];          /* two buffers, LOGBUF bytes each */
+unsigned log_word = 0;      /* LOGCUR bit | bytes reserved in it */
+unsigned log_full[2];       /* end of the data if records did not fit */
+unsigned log_dropped = 0;   /* records that did not fit */
+
+/*
+ * 作业记录按slab分配：每个slab放JOBSLAB个job_t，用一个64位的位图记录
+ * 哪些记录在用。slab一旦分配就不会移动，所以信号处理程序拿到的job指针
+ * 一直有效；槽位号slot = slab下标 * JOBSLAB + slab内下标。
+ */
+struct jobslab_t {
+    uint64_t used;          /* bit i set if jobs[i] is in use */
+    struct job_t jobs[JOBSLAB];
+};
+
+/*
+ * 紧挨着作业表的两张索引表：PID -> 槽位 和 JID -> 槽位。
+ * 开放定址（线性探测），key为0表示空位，删除时做backward shift，
+ * 不需要墓碑，所以查找、插入、删除都是O(1)，不随作业数增长。
+ */
+struct jobent_t {
+    int key;                /* PID or JID, 0 if the entry is empty */
+    int slot;               /* slot of the job */
+    int fd;                 /* pidfd of the process (PID index), -1 if none */
+    int live;               /* process not reaped yet (PID index) */
+    struct timeval cpu;     /* its CPU time at the last stop/continue */
+};
+struct jobidx_t {
+    struct jobent_t *ent;   /* 1 << bits entries */
+    int bits;               /* log2 of the index size */
+    int count;              /* live entries */
+    int reserved;           /* entries that may be added without growing */
+};
+
+/*
+ * 作业表。只有主程序（在屏蔽了所有信号的情况下）会分配slab、扩大索引；
+ * sigchld_handler只会查找和删除，不会调用malloc/free，所以是异步信号安全的。
+ */
+struct joblist_t {
+    struct jobslab_t **slabs; /* slab directory, grows on demand */
+    int nslabs;             /* number of slabs in the directory */
+    int njobs;              /* live jobs */
+    int limit;              /* max live jobs (-n or TSH_MAXJOBS) */
+    int hint;               /* lowest slab that may have a free record */
+    volatile pid_t fg;      /* PID of the FG job, 0 if none */
+    /* 
+     * JID分配位图：JID j对应jidmap的第j-1位。上面再加一层摘要，
+     * jidany的第w位表示jidmap[w]里有在用的JID，jidfull的第w位表示
+     * jidmap[w]已经满了，所以分配和释放都只看常数个字。
+     */
+    uint64_t jidmap[JIDWORDS];
+    uint64_t jidany[JIDWORDS / 64];
+    uint64_t jidfull[JIDWORDS / 64];
+    struct jobidx_t pids;   /* PID -> slot */
+    struct jobidx_t jids;   /* JID -> slot */
+    int running;            /* jobs in the BG state */
+    int maxrun;             /* max BG jobs before queueing, 0 = no limit */
+    struct job_t *qhead, *qtail; /* FIFO of QUEUED jobs */
+    unsigned long serial;   /* jobs created so far */
+    int newest;             /* JID of the job created last */
 };
-struct job_t job_list[MAXJOBS]; /* The job list */
+int *proc_first = NULL;     /* chain_procs: first live process of each slot */
+int *proc_next = NULL;      /* chain_procs: next process of the same job */
+struct joblist_t job_table;
+struct joblist_t *job_list = &job_table; /* The job list */
 
 struct cmdline_tokens {
     int argc;               /* Number of arguments */
-    char *argv[MAXARGS];    /* The arguments list */
-    char *infile;           /* The input file */
-    char *outfile;          /* The output file */
+    char *argv[MAXARGS];    /* The arguments list, NULL between stages */
+    int nstages;            /* Number of commands in the pipeline */
+    int stage[MAXSTAGES];   /* Index in argv where each command starts */
+    char *infile;           /* The input file (first command) */
+    char *outfile;          /* The output file (last command) */
     enum builtins_t {       /* Indicates if argv[0] is a builtin command */
         BUILTIN_NONE,
         BUILTIN_QUIT,
@@ -71,7 +402,12 @@ struct cmdline_tokens {
         BUILTIN_BG,
         BUILTIN_FG,
         BUILTIN_KILL,
-        BUILTIN_NOHUP} builtins;
+        BUILTIN_NOHUP,
+        BUILTIN_HASH,
+        BUILTIN_SETMAX,
+        BUILTIN_WAIT,
+        BUILTIN_PARALLEL,
+        BUILTIN_STATS} builtins;
 };
 
 /* End global variables */
@@ -82,21 +418,59 @@ void eval(char *cmdline);
 void sigchld_handler(int sig);
 void sigtstp_handler(int sig);
 void sigint_handler(int sig);
+void reap_children(void);
+int siginfo_status(const siginfo_t *info);
+void child_changed(pid_t pid, int status, const struct rusage *ru);
+void report_times(void);
+void relay_signal(int sig);
+void init_events(void);
+int wait_event(int want_stdin);
+void serve_ctl(int fd);
+int watch_pid(pid_t pid);
+void unwatch_pid(int fd);
+char *read_cmdline(char *buf, int size);
+void poll_events(void);
+void batch_open(const char *file, const char *string);
+char *batch_next(void);
 
 /* Here are helper routines that we've provided for you */
 int parseline(const char *cmdline, struct cmdline_tokens *tok); 
 void sigquit_handler(int sig);
 
 void clearjob(struct job_t *job);
-void initjobs(struct job_t *job_list);
-int maxjid(struct job_t *job_list); 
-int addjob(struct job_t *job_list, pid_t pid, int state, char *cmdline);
-int deletejob(struct job_t *job_list, pid_t pid); 
-pid_t fgpid(struct job_t *job_list);
-struct job_t *getjobpid(struct job_t *job_list, pid_t pid);
-struct job_t *getjobjid(struct job_t *job_list, int jid); 
+void initjobs(struct joblist_t *job_list);
+int maxjid(struct joblist_t *job_list); 
+int allocjid(struct joblist_t *job_list);
+void freejid(struct joblist_t *job_list, int jid);
+int addjob(struct joblist_t *job_list, pid_t pid, int state, char *cmdline);
+int addjobpid(struct joblist_t *job_list, struct job_t *job, pid_t pid);
+struct job_t *newjob(struct joblist_t *job_list, int state, char *cmdline);
+void freejob(struct joblist_t *job_list, struct job_t *job);
+int deletejob(struct joblist_t *job_list, pid_t pid); 
+pid_t fgpid(struct joblist_t *job_list);
+struct job_t *getjobpid(struct joblist_t *job_list, pid_t pid);
+struct job_t *getjobjid(struct joblist_t *job_list, int jid); 
 int pid2jid(pid_t pid); 
-void listjobs(struct job_t *job_list, int output_fd);
+void listjobs(struct joblist_t *job_list, int output_fd, int long_fmt);
+void setjobstate(struct joblist_t *job_list, struct job_t *job, int state);
+struct job_t *jobslot(struct joblist_t *job_list, int slot);
+struct job_t *nextjob(struct joblist_t *job_list, int *slot);
+void jobidx_init(struct jobidx_t *index, int bits);
+void jobidx_insert(struct jobidx_t *index, int key, int slot);
+int jobidx_lookup(struct jobidx_t *index, int key);
+void jobidx_remove(struct jobidx_t *index, int key);
+struct jobent_t *jobidx_find(struct jobidx_t *index, int key);
+void jobidx_reserve(struct jobidx_t *index, int n);
+int signal_job(struct job_t *job, int sig, int group);
+int signal_pid(struct job_t *job, pid_t pid, int sig);
+pid_t live_stage(struct job_t *job);
+void *arena_alloc(struct arena_t *arena, size_t size);
+void arena_free(struct arena_t *arena, void *p);
+char *arena_strdup(struct arena_t *arena, const char *s);
+
+const char *resolve_cmd(const char *name);
+void cmdcache_clear(struct cmdcache_t *cache);
+void conduct_hash(char **argv);
 
 void usage(void);
 void unix_error(char *msg);
@@ -104,8 +478,32 @@ void app_error(char *msg);
 ssize_t sio_puts(char s[]);
 ssize_t sio_putl(long v);
 ssize_t sio_put(const char *fmt, ...);
+ssize_t sio_format(char *buf, size_t size, const char *fmt, ...);
 void sio_error(char s[]);
+void push_notice(int kind, struct job_t *job, int sig, int flags);
+long now_ns(void);
+void hist_add(int h, long ns);
+void count_event(int c);
+void conduct_stats(char **argv);
+void print_stats(FILE *fp, int json);
+int open_unix_listenfd(char *path);
+int Open_unix_listenfd(char *path);
+void init_ctl(char *path);
+static const char *state_name(int state);
+static void chain_procs(struct joblist_t *job_list);
+static void jobcpu(struct joblist_t *job_list, int slot, struct job_t *job, struct timeval *cpu);
+void log_event(const char *event, pid_t pid, struct job_t *job, const char *key, long val);
+void flush_log(int force);
+static void flush_log_all(void);
+void flush_notices(void);
+static void write_notices(int release);
 pid_t Fork(void); // Fork的错误处理包装函数
+int parse_prefix(struct cmdline_tokens *tok, struct jobprefix_t *pre);
+void set_prefix(struct job_t *job, struct jobprefix_t *pre);
+int apply_prefix(const struct jobprefix_t *pre);
+pid_t launch_stage(const char *path, char **argv, pid_t pgid, int fd_in, int fd_out,
+                   const sigset_t *child_mask, const struct jobprefix_t *pre);
+int parse_engine(const char *name);
 int builtin_cmd(char **argv, struct  cmdline_tokens *tok); // 判断是否是内建命令的函数
 void Sigfillset(sigset_t *set);
 void Sigemptyset(sigset_t *set);
@@ -118,6 +516,16 @@ void waitfg(pid_t pid);
 void conduct_bgfg(char **argv);
 int Dup2(int oldfd, int newfd);
 void conduct_kill(char **argv);
+static void kill_job(char *id);
+struct launchspec_t *make_spec(struct cmdline_tokens *tok, struct jobprefix_t *pre, char *cmdline);
+void enqueue_job(struct cmdline_tokens *tok, char *cmdline, struct jobprefix_t *pre, struct timespec *submit);
+void unqueue_job(struct joblist_t *job_list, struct job_t *job);
+void drop_queued(struct job_t *job);
+int start_job(struct joblist_t *job_list, struct job_t *job, int state);
+void launch_queued(struct joblist_t *job_list);
+void conduct_setmax(char **argv);
+void conduct_wait(char **argv);
+void conduct_parallel(char **argv, struct cmdline_tokens *tok);
 
 typedef void handler_t(int);
 handler_t *Signal(int signum, handler_t *handler);
@@ -132,13 +540,27 @@ main(int argc, char **argv)
     char c;
     char cmdline[MAXLINE];    /* cmdline for fgets */
     int emit_prompt = 1; /* emit prompt (default) */
+    int eof;
+    char *env, *line;
+    char *script = NULL;      /* -c string */
+
+    /* 作业表容量：环境变量TSH_MAXJOBS，可以被-n覆盖 */
+    job_list->limit = MAXJOBS;
+    if ((env = getenv("TSH_MAXJOBS")) != NULL)
+        job_list->limit = atoi(env);
+    /* 启动方式：环境变量TSH_LAUNCH，可以被-e覆盖 */
+    if ((env = getenv("TSH_LAUNCH")) != NULL && parse_engine(env) < 0)
+        usage();
+    /* 事件循环：环境变量TSH_EVENTS，可以被-E打开 */
+    if ((env = getenv("TSH_EVENTS")) != NULL && *env != '\0' && strcmp(env, "0"))
+        event_mode = 1;
 
     /* Redirect stderr to stdout (so that driver will get all output
      * on the pipe connected to stdout) */
     dup2(1, 2);
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != EOF) {
+    while ((c = getopt(argc, argv, "hvpn:e:Ec:j:L:S:")) != EOF) {
         switch (c) {
         case 'h':             /* print help message */
             usage();
@@ -149,17 +571,56 @@ main(int argc, char **argv)
         case 'p':             /* don't print a prompt */
             emit_prompt = 0;  /* handy for automatic testing */
             break;
+        case 'n':             /* job table capacity */
+            job_list->limit = atoi(optarg);
+            break;
+        case 'e':             /* launch engine: fork or spawn */
+            if (parse_engine(optarg) < 0)
+                usage();
+            break;
+        case 'E':             /* signalfd event loop instead of handlers */
+            event_mode = 1;
+            break;
+        case 'c':             /* run the commands in the string and exit */
+            script = optarg;
+            break;
+        case 'j':             /* max running background jobs (setmax) */
+            job_list->maxrun = atoi(optarg);
+            break;
+        case 'L':             /* append job lifecycle events to a file */
+            if ((log_fd = open(optarg, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+                unix_error(optarg);
+            if ((log_bufs[0] = malloc(2 * LOGBUF)) == NULL)
+                unix_error("malloc error");
+            log_bufs[1] = log_bufs[0] + LOGBUF;
+            break;
+        case 'S':             /* serve the job table on a unix socket */
+            ctl_path = optarg;
+            event_mode = 1;   /* the socket is served by the event loop */
+            break;
         default:
             usage();
         }
     }
+    if (optind < argc - 1 || (script != NULL && optind < argc))
+        usage();
 
     /* Install the signal handlers */
 
+    /* 子进程用shell启动时的信号屏蔽字，事件循环会一直屏蔽下面三个信号 */
+    Sigprocmask(SIG_SETMASK, NULL, &child_mask);
+
     /* These are the ones you will need to implement */
-    Signal(SIGINT,  sigint_handler);   /* ctrl-c */
-    Signal(SIGTSTP, sigtstp_handler);  /* ctrl-z */
-    Signal(SIGCHLD, sigchld_handler);  /* Terminated or stopped child */
+    if (event_mode) {
+        init_events();                 /* read them from sig_fd instead */
+        if (ctl_path != NULL)
+            init_ctl(ctl_path);
+    }
+    else {
+        Signal(SIGINT,  sigint_handler);   /* ctrl-c */
+        Signal(SIGTSTP, sigtstp_handler);  /* ctrl-z */
+        Signal(SIGCHLD, sigchld_handler);  /* Terminated or stopped child */
+    }
     Signal(SIGTTIN, SIG_IGN);
     Signal(SIGTTOU, SIG_IGN);
 
@@ -167,18 +628,51 @@ main(int argc, char **argv)
     Signal(SIGQUIT, sigquit_handler); 
 
     /* Initialize the job list */
+    if (job_list->limit < 1 || job_list->limit > MAXJID)
+        app_error("job capacity must be between 1 and 65536");
+    if (job_list->maxrun < 0)
+        app_error("max running jobs must not be negative");
     initjobs(job_list);
+    atexit(flush_notices);  /* quit、EOF和批处理结束时不要丢了通知 */
+    atexit(flush_log_all);
+
+    /* 批处理模式：命令来自-c或者脚本文件，不打印提示符 */
+    if (script != NULL || optind < argc)
+        batch_open(optind < argc ? argv[optind] : NULL, script);
 
     /* Execute the shell's read/eval loop */
+    while (batch.active) {
+        // 一行一行地执行，不打印提示符，也不在每行之后fflush
+        if ((line = batch_next()) == NULL) {
+            fflush(stdout);
+            exit(0);
+        }
+        if (event_mode)
+            poll_events();  // 不用等stdin，顺便回收已经结束的后台作业
+        flush_notices();    // 上一条命令之后结束的作业先报告
+        eval(line);
+        flush_notices();
+        report_times();
+        flush_log(0);
+    }
+
     while (1) {
 
+        flush_notices();    // 后台作业的通知在提示符之前打印
         if (emit_prompt) {
             printf("%s", prompt);
             fflush(stdout);
         }
-        if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-            app_error("fgets error");
-        if (feof(stdin)) { 
+        if (event_mode) {
+            // stdin和信号一起等，不能经过stdio的缓冲区
+            eof = (read_cmdline(cmdline, MAXLINE) == NULL);
+        }
+        else {
+            if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
+                app_error("fgets error");
+            eof = feof(stdin);
+        }
+        if (eof) { 
             /* End of file (ctrl-d) */
             printf ("\n");
             fflush(stdout);
@@ -187,10 +681,16 @@ main(int argc, char **argv)
         }
         
         /* Remove the trailing newline */
-        cmdline[strlen(cmdline)-1] = '\0';
+        if (cmdline[0] != '\0' && cmdline[strlen(cmdline)-1] == '\n')
+            cmdline[strlen(cmdline)-1] = '\0';
         
+        /* 等输入的时候结束的后台作业，在这条命令的输出之前报告 */
+        flush_notices();
+
         /* Evaluate the command line */
         eval(cmdline);
+        report_times();
+        flush_log(0);
         
         fflush(stdout);
         fflush(stdout);
@@ -203,8 +703,9 @@ main(int argc, char **argv)
  * eval - Evaluate the command line that the user has just typed in
  * 
  * If the user has requested a built-in command (quit, jobs, bg or fg)
- * then execute it immediately. Otherwise, fork a child process and
- * run the job in the context of the child. If the job is running in
+ * then execute it immediately. Otherwise, fork a child process for
+ * each command of the pipeline and run the job in the context of the
+ * children. If the job is running in
  * the foreground, wait for it to terminate and then return.  Note:
  * each child process must have a unique process group ID so that our
  * background children don't receive SIGINT (SIGTSTP) from the kernel
@@ -215,116 +716,131 @@ eval(char *cmdline)
 {
     int bg;              /* should the job run in bg or fg? */
     struct cmdline_tokens tok;
-    pid_t pid;
+    pid_t pid, pgid;     /* last launched process, process group of the job */
+    const char *path;    /* resolved argv[0] of a stage */
+    int i, pipe_in = -1; /* read end of the pipe feeding the next stage */
+    struct job_t *job;
+    struct jobprefix_t pre; /* time, cpus and nice prefixes */
+    struct timespec submit;
+    long t0 = now_ns(), forked;
     /* Parse command line */
     bg = parseline(cmdline, &tok); 
     if (bg == -1) /* parsing error */
         return;
     if (tok.argv[0] == NULL) /* ignore empty lines */
         return;
+    // time、cpus、nice前缀：第一个命令从前缀后面的词开始
+    if (parse_prefix(&tok, &pre) < 0)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &submit);
+    hist_add(H_PARSE, submit.tv_sec * 1000000000L + submit.tv_nsec - t0);
+    log_event("parse", 0, NULL, NULL, 0);
 
     // 在调用Fork之前，先屏蔽SIGCHLD信号
     sigset_t mask_all, mask_one, prev_one;
     Sigfillset(&mask_all);
-    Sigemptyset(&mask_one);
-    Sigaddset(&mask_one, SIGCHLD);
 
-    if (pipe(pipe_fd) < 0) { // 创建管道
-        unix_error("pipe error");
-        exit(EXIT_FAILURE);
-    }
+    // 内建命令不计时，time jobs就是jobs
+    if (tok.nstages > 1 || !builtin_cmd(&tok.argv[tok.stage[0]], &tok)) {
+        // setmax：后台作业已经够多了（或者前面还有人在排队），就先排队
+        if (bg && job_list->maxrun > 0
+            && (job_list->running >= job_list->maxrun || job_list->qhead != NULL)) {
+            enqueue_job(&tok, cmdline, &pre, &submit);
+            return;
+        }
 
-    if (!builtin_cmd(tok.argv, &tok)) {
-        // 如果不是内建命令，那么就fork一个子进程
-        Sigprocmask(SIG_BLOCK, &mask_one, &prev_one); // 在fork之前，先屏蔽SIGCHLD信号
-        if ((pid = Fork()) == 0) {
-            // 当前是在子进程里了
-            Sigprocmask(SIG_SETMASK, &prev_one, NULL);  // 解除屏蔽
-
-            // 关于重定向的部分应该写在子进程里面
-            // 如果有重定向的话，那么就需要先打开文件
-            int fd_in = -1, fd_out = -1;
-            if (tok.infile != NULL) {
-                fd_in = open(tok.infile, O_RDONLY);
-                if (fd_in < 0) {
-                    printf("%s: No such file or directory\n", tok.infile);
-                    fflush(stdout);
-                    exit(EXIT_FAILURE);
-                }
+        // 重定向文件在父进程里打开（带O_CLOEXEC），打不开的话不用启动任何进程
+        int fd_in = -1, fd_out = -1;
+        if (tok.infile != NULL) {
+            fd_in = open(tok.infile, O_RDONLY | O_CLOEXEC);
+            if (fd_in < 0) {
+                printf("%s: No such file or directory\n", tok.infile);
+                fflush(stdout);
+                return;
             }
-            if (tok.outfile != NULL) {
-                fd_out = open(tok.outfile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-                if (fd_out < 0) {
-                        printf("%s: No such file or directory\n", tok.outfile);
-                        fflush(stdout);
-                        exit(EXIT_FAILURE);
-                }
+        }
+        if (tok.outfile != NULL) {
+            fd_out = open(tok.outfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+            if (fd_out < 0) {
+                printf("%s: No such file or directory\n", tok.outfile);
+                fflush(stdout);
+                if (fd_in != -1)
+                    close(fd_in);
+                return;
             }
+        }
 
-            // 从重定向的文件中读取输入
-            if (fd_in != -1) {
-                Dup2(fd_in, STDIN_FILENO);
-                close(fd_in);
+        // 如果不是内建命令，那么就启动子进程，管道里的每个命令一个，
+        // 都放在第一个命令的进程组里，整个管道是一个作业。
+        // 启动之前先屏蔽所有信号：子进程exec以后可能马上给我们发信号
+        // （比如myintp），也可能马上就结束了，这些信号都会被挂起，
+        // 等addjob之后再处理，所以父子进程之间不需要管道握手
+        Sigprocmask(SIG_BLOCK, &mask_all, &prev_one);
+        forked = now_ns();
+        mask_one = prev_one;  // 事件循环模式下prev_one里已经屏蔽了SIGINT等
+        Sigaddset(&mask_one, SIGCHLD);
+        job = NULL;
+        pgid = 0;
+        for (i = 0; i < tok.nstages; i++) {
+            char **argv = &tok.argv[tok.stage[i]];
+            int in = (i == 0) ? fd_in : pipe_in;
+            int out = fd_out, pipe_fd[2];
+
+            if (i < tok.nstages - 1) {
+                if (pipe2(pipe_fd, O_CLOEXEC) < 0)
+                    unix_error("pipe error");
+                out = pipe_fd[1];
             }
-            // 将输出重定向到文件中
-            if (fd_out != -1) {
-                Dup2(fd_out, STDOUT_FILENO);
-                close(fd_out);
+
+            // 没有'/'的命令名在PATH里找，结果缓存在cmd_cache里
+            if ((path = resolve_cmd(argv[0])) == NULL) {
+                printf("%s: Command not found\n", argv[0]);
+                fflush(stdout);
+                pid = 0;
             }
+            else
+                pid = launch_stage(path, argv, pgid, in, out, &child_mask, &pre);
+
+            // 父进程不需要管道的这两端了，子进程已经dup2过去了
+            if (in != -1)
+                close(in);
+            if (i < tok.nstages - 1) {
+                close(out);
+                pipe_in = pipe_fd[0];
+            }
+            else if (fd_out != -1)
+                close(fd_out);
 
-            // 设置子进程的进程组
-            // After the fork, but before the execve, the child process should call
-            // setpgid(0, 0), which puts the child in a new process group whose group ID is identical to the
-            // child’s PID. This ensures that there will be only one process, your shell, in the foreground process
-            // group. 
-            setpgid(0, 0);
-            fflush(stdout);
-            // 一定要等到父进程设置完子进程的进程组之后，才能执行execve
-            close(pipe_fd[1]); // 关闭管道的写端，因为只读
-            // 等待父进程的通知
-            char dummy;
-            while (read(pipe_fd[0], &dummy, 1) != 0) { }
-            close(pipe_fd[0]);
-            
-            // 执行命令
-            Execve(tok.argv[0], tok.argv, environ);
-            _exit(0);
+            if (pid <= 0)
+                continue;
+            if (pgid == 0) {
+                // 添加到job_list
+                pgid = pid;
+                if (addjob(job_list, pid, bg ? BG : FG, cmdline)) {
+                    job = getjobpid(job_list, pid);
+                    set_prefix(job, &pre);
+                    job->info->start = submit;
+                }
+            }
+            else if (job != NULL)
+                addjobpid(job_list, job, pid);
+            log_event("fork", pid, job, "stage", i);
         }
-        else {
-            // 父进程
-            // 如果是后台进程，那么就不需要等待子进程结束
+
+        if (job != NULL) {
+            // 作业已经在表里了，解除屏蔽以后信号处理程序才能看到它的进程
+            clock_gettime(CLOCK_MONOTONIC, &job->info->launched);
+            hist_add(H_LAUNCH, job->info->launched.tv_sec * 1000000000L + job->info->launched.tv_nsec - forked);
+            log_event("release", pgid, job, NULL, 0);
+            Sigprocmask(SIG_SETMASK, &mask_one, NULL);  // 解除屏蔽
             if (bg) {
-                Sigprocmask(SIG_BLOCK, &mask_all, NULL); // 在添加到job_list之前，先屏蔽所有信号
-                // 添加到job_list
-                addjob(job_list, pid, BG, cmdline);
-                fflush(stdout);
-                // 通知子进程可以执行execve了
-                close(pipe_fd[0]); // 关闭管道的读端，因为只写
-                char dummy = 'a';
-                write(pipe_fd[1], &dummy, 1);
-                close(pipe_fd[1]);
-
-                Sigprocmask(SIG_SETMASK, &mask_one, NULL);  // 解除屏蔽
-                // 打印信息
-                printf("[%d] (%d) %s\n", pid2jid(pid), pid, cmdline);
+                // 如果是后台进程，那么就不需要等待子进程结束，打印信息
+                printf("[%d] (%d) %s\n", job->jid, pgid, cmdline);
                 fflush(stdout);
             }
             else {
-                Sigprocmask(SIG_BLOCK, &mask_all, NULL); // 在添加到job_list之前，先屏蔽所有信号
-                // 如果是前台进程，那么就需要等待子进程结束
-                addjob(job_list, pid, FG, cmdline);
-                // printf("[%d] (%d) %s\n", pid2jid(pid), pid, cmdline); // 确认是加入了job_list，而且在收到SIGCHLD信号之前，不会有其他进程修改job_list
-                fflush(stdout);
-
-                // 通知子进程可以执行execve了
-                close(pipe_fd[0]); // 关闭管道的读端，因为只写
-                char dummy = 'a';
-                write(pipe_fd[1], &dummy, 1);
-                close(pipe_fd[1]);
-
-                // 等待前台进程结束
-                Sigprocmask(SIG_SETMASK, &mask_one, NULL);  // 解除屏蔽
-                waitfg(pid);
+                // 如果是前台进程，那么就需要等待整个管道结束
+                waitfg(pgid);
             }
         }
         Sigprocmask(SIG_SETMASK, &prev_one, NULL);  // 解除屏蔽
@@ -339,6 +855,7 @@ eval(char *cmdline)
  *   cmdline:  The command line, in the form:
  *
  *                command [arguments...] [< infile] [> oufile] [&]
+ *                command [< infile] | command ... | command [> outfile] [&]
  *
  *   tok:      Pointer to a cmdline_tokens structure. The elements of this
  *             structure will be populated with the parsed tokens. Characters 
@@ -381,15 +898,42 @@ parseline(const char *cmdline, struct cmdline_tokens *tok)
     /* Build the argv list */
     parsing_state = ST_NORMAL;
     tok->argc = 0;
+    tok->nstages = 1;
+    tok->stage[0] = 0;
 
     while (buf < endbuf) {
         /* Skip the white-spaces */
         buf += strspn (buf, delims);
         if (buf >= endbuf) break;
 
+        /* Check for pipes: NULL-terminate this command, start the next */
+        if (*buf == '|') {
+            if (parsing_state != ST_NORMAL) {
+                (void) fprintf(stderr,
+                               "Error: must provide file name for redirection\n");
+                return -1;
+            }
+            if (tok->argc == tok->stage[tok->nstages-1]) {
+                (void) fprintf(stderr, "Error: missing command in pipeline\n");
+                return -1;
+            }
+            if (tok->outfile) {
+                (void) fprintf(stderr, "Error: Ambiguous I/O redirection\n");
+                return -1;
+            }
+            if (tok->nstages == MAXSTAGES) {
+                (void) fprintf(stderr, "Error: too many commands in pipeline\n");
+                return -1;
+            }
+            tok->argv[tok->argc++] = NULL;
+            tok->stage[tok->nstages++] = tok->argc;
+            buf++;
+            continue;
+        }
+
         /* Check for I/O redirection specifiers */
         if (*buf == '<') {
-            if (tok->infile) {
+            if (tok->infile || tok->nstages > 1) {
                 (void) fprintf(stderr, "Error: Ambiguous I/O redirection\n");
                 return -1;
             }
@@ -473,14 +1017,32 @@ parseline(const char *cmdline, struct cmdline_tokens *tok)
         tok->builtins = BUILTIN_KILL;
     } else if (!strcmp(tok->argv[0], "nohup")) {            /* kill command */
         tok->builtins = BUILTIN_NOHUP;
+    } else if (!strcmp(tok->argv[0], "hash")) {          /* hash command */
+        tok->builtins = BUILTIN_HASH;
+    } else if (!strcmp(tok->argv[0], "setmax")) {        /* setmax command */
+        tok->builtins = BUILTIN_SETMAX;
+    } else if (!strcmp(tok->argv[0], "wait")) {          /* wait command */
+        tok->builtins = BUILTIN_WAIT;
+    } else if (!strcmp(tok->argv[0], "parallel")) {      /* parallel command */
+        tok->builtins = BUILTIN_PARALLEL;
+    } else if (!strcmp(tok->argv[0], "stats")) {         /* stats command */
+        tok->builtins = BUILTIN_STATS;
     } else {
         tok->builtins = BUILTIN_NONE;
     }
 
     /* Should the job run in the background? */
-    if ((is_bg = (*tok->argv[tok->argc-1] == '&')) != 0)
+    if (tok->argc == tok->stage[tok->nstages-1])
+        is_bg = 0;
+    else if ((is_bg = (*tok->argv[tok->argc-1] == '&')) != 0)
         tok->argv[--tok->argc] = NULL;
 
+    /* Every command of a pipeline needs at least one word */
+    if (tok->nstages > 1 && tok->argc == tok->stage[tok->nstages-1]) {
+        (void) fprintf(stderr, "Error: missing command in pipeline\n");
+        return -1;
+    }
+
     return is_bg;
 }
 
@@ -501,65 +1063,173 @@ sigchld_handler(int sig)
 {
     // P536 要保存和恢复errno
     int olderrno = errno;
-    int status; // waitpid的一个参数
-    pid_t pid;
     sigset_t mask_all, prev_all; 
     // 如果处理程序和主程序共享一个全局数据结构，那么就需要在处理程序中屏蔽所有信号
     Sigfillset(&mask_all);
+    Sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+    reap_children();
+    Sigprocmask(SIG_SETMASK, &prev_all, NULL);
+    errno = olderrno;
+    return;
+}
+
+/* 
+ * reap_children - Reap every child that has terminated, stopped or 
+ *     continued and update the job list. Called with signals blocked,
+ *     from sigchld_handler or synchronously from the event loop.
+ *
+ * 事件循环模式下退出的进程由各自的pidfd回收（见reap_pidfd），这里只处理
+ * 停止和继续；如果有子进程没拿到pidfd，就还是用waitpid(-1, ...)全部回收。
+ */
+void 
+reap_children(void) 
+{
+    int status; // waitpid的一个参数
+    pid_t pid;
+    siginfo_t info;
+    struct rusage ru;
+
+    if (event_mode && untracked == 0) {
+        while (1) {
+            info.si_pid = 0;
+            if (syscall(SYS_waitid, P_ALL, 0, &info, WSTOPPED | WCONTINUED | WNOHANG, &ru) < 0
+                || info.si_pid == 0)
+                break;
+            child_changed(info.si_pid, siginfo_status(&info), &ru);
+        }
+        return;
+    }
 
-    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
+    // wait4和waitpid一样，只是顺便把子进程的资源使用情况填到ru里
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0) {
         // WNOHANG | WUNTRACED: 如果没有子进程终止或者停止，那么waitpid就会立即返回0
         // 如果有子进程终止或者停止，那么waitpid就会返回子进程的pid
-        Sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
-        if (WIFEXITED(status)) {
-            // 如果子进程正常终止，那么就删除job_list中的记录
-            deletejob(job_list, pid);
-            fflush(stdout);
-        }
-        else if (WIFSIGNALED(status)) {
-            // 如果子进程是因为信号终止的，那么就打印信息
+        child_changed(pid, status, &ru);
+    }
+}
+
+/* ru_add - Add the usage of one more process to sum (max RSS is a max) */
+static void 
+ru_add(struct rusage *sum, const struct rusage *ru) 
+{
+    timeradd(&sum->ru_utime, &ru->ru_utime, &sum->ru_utime);
+    timeradd(&sum->ru_stime, &ru->ru_stime, &sum->ru_stime);
+    if (ru->ru_maxrss > sum->ru_maxrss)
+        sum->ru_maxrss = ru->ru_maxrss;
+    sum->ru_nvcsw += ru->ru_nvcsw;
+    sum->ru_nivcsw += ru->ru_nivcsw;
+}
+
+/* 
+ * cpu_limit_hit - 作业是不是被limit cpu=杀死的：到了软限制内核发SIGXCPU，
+ *     到了硬限制发SIGKILL（这时用掉的CPU时间已经超过了限制）
+ */
+static int 
+cpu_limit_hit(struct job_t *job) 
+{
+    int sig = WTERMSIG(job->status);
+
+    if (job->info->pre.lim.cpu == 0)
+        return 0;
+    return sig == SIGXCPU
+           || (sig == SIGKILL && (rlim_t)(job->info->ru.ru_utime.tv_sec + job->info->ru.ru_stime.tv_sec)
+                                 >= job->info->pre.lim.cpu);
+}
+
+/* 
+ * time_done - The last process of a `time` job was reaped: queue its 
+ *     report for report_times. 只用clock_gettime，异步信号安全。
+ */
+static void 
+time_done(struct job_t *job) 
+{
+    struct timereport_t *r;
+    struct timespec now;
+
+    if (nreports == MAXREPORTS)
+        return;
+    r = &time_reports[nreports];
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    r->jid = job->jid;
+    r->pid = job->pid;
+    r->real.tv_sec = now.tv_sec - job->info->start.tv_sec;
+    r->real.tv_nsec = now.tv_nsec - job->info->start.tv_nsec;
+    if (r->real.tv_nsec < 0) {
+        r->real.tv_sec--;
+        r->real.tv_nsec += 1000000000L;
+    }
+    r->ru = job->info->ru;
+    nreports++;
+}
+
+/* 
+ * child_changed - Update the job list after process pid changed state. 
+ *     status is a wait status as returned by waitpid, ru the resource 
+ *     usage of the process if it was reaped (NULL otherwise).
+ */
+void 
+child_changed(pid_t pid, int status, const struct rusage *ru) 
+{
+    struct job_t *job;
+    struct jobent_t *ent;
+
+    // 管道里的每个进程都会来一次，作业的状态只看最后一个命令，
+    // 信息也只在整个作业结束或者第一次停下来的时候打印一次
+    job = getjobpid(job_list, pid);
+    if (job != NULL && !job->info->heard && job->info->launched.tv_sec != 0) {
+        job->info->heard = 1;
+        hist_add(H_FIRSTCHLD, now_ns() - (job->info->launched.tv_sec * 1000000000L + job->info->launched.tv_nsec));
+    }
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        count_event(C_REAPED);
+        if (job != NULL && pid == job->lastpid)
+            job->status = status;
+        if (job != NULL && ru != NULL)
+            ru_add(&job->info->ru, ru);
+        if (job != NULL && job->nprocs == 1 && job->info->pre.timed)
+            time_done(job);
+        if (job != NULL && job->nprocs == 1 && WIFSIGNALED(job->status)) {
+            // 如果作业是因为信号终止的，那么就打印信息
             // printf("Job [%d] (%d) terminated by signal %d\n", pid2jid(pid), pid, WTERMSIG(status));
-            // 在信号处理程序里不可以使用异步信号不安全的函数，比如printf
-            // 所以使用sio_put来代替printf
+            // 在信号处理程序里不可以使用printf，也不在这里write：
+            // 只记一条通知，主程序之后统一打印
             // WTERMSIG(status)返回导致子进程终止的信号的编号
-            sio_puts("Job ["); // 因为sio_put不支持%d，所以只能一个一个输出
-            sio_putl(pid2jid(pid));
-            sio_puts("] (");
-            sio_putl(pid);
-            sio_puts(") terminated by signal ");
-            sio_putl(WTERMSIG(status));
-            sio_puts("\n");
-            fflush(stdout);
-            // 然后删除job_list中的记录
-            deletejob(job_list, pid);
-            fflush(stdout);
+            push_notice(NOTICE_TERM, job, WTERMSIG(job->status),
+                        cpu_limit_hit(job) ? NOTICE_CPULIMIT : 0);
             // trace13 passed
         }
-        else if (WIFSTOPPED(status)) {
-            // 如果子进程是因为信号停止的，那么就打印信息
-            // printf("Job [%d] (%d) stopped by signal %d\n", pid2jid(pid), pid, WSTOPSIG(status));
-            sio_puts("Job [");
-            sio_putl(pid2jid(pid));
-            sio_puts("] (");
-            sio_putl(pid);
-            sio_puts(") stopped by signal ");
-            sio_putl(WSTOPSIG(status)); // 和WTERMSIG一样，返回导致子进程停止的信号的编号
-            sio_puts("\n");
-            fflush(stdout);
+        // 然后删除job_list中的记录，最后一个进程回收以后作业才真正删除
+        log_event("reap", pid, job, "status", status);
+        deletejob(job_list, pid);
+    }
+    else if (ru != NULL && (ent = jobidx_find(&job_list->pids, pid)) != NULL) {
+        // 停止和继续的时候内核也会填ru，记下这个进程到目前为止的CPU时间
+        timeradd(&ru->ru_utime, &ru->ru_stime, &ent->cpu);
+    }
+    if (WIFSTOPPED(status)) {
+        // 如果子进程是因为信号停止的，那么就打印信息
+        // printf("Job [%d] (%d) stopped by signal %d\n", pid2jid(pid), pid, WSTOPSIG(status));
+        if (job != NULL && job->state != ST) {
+            // 和WTERMSIG一样，WSTOPSIG返回导致子进程停止的信号的编号
+            push_notice(NOTICE_STOP, job, WSTOPSIG(status), 0);
+            count_event(C_STOPS);
+            log_event("stop", pid, job, "sig", WSTOPSIG(status));
             // 然后修改job_list中的记录
-            getjobpid(job_list, pid)->state = ST;
-            fflush(stdout);
-            // trace14 passed
+            setjobstate(job_list, job, ST);
         }
-	else if (WIFCONTINUED(status)) {
-		// 修改state为BG
-		getjobpid(job_list, pid)->state = BG;
-	}
-        Sigprocmask(SIG_SETMASK, &prev_all, NULL);
+        // trace14 passed
+    }
+    else if (WIFCONTINUED(status)) {
+        // 修改state为BG；如果是fg命令让它继续的，状态已经是FG了，不能改
+        if (job != NULL && job->state == ST)
+            setjobstate(job_list, job, BG);
+        count_event(C_CONTS);
+        log_event("cont", pid, job, NULL, 0);
     }
 
-    errno = olderrno;
-    return;
+    // 后台作业少了一个（结束或者停止了），让排队的作业补上
+    if (job_list->qhead != NULL)
+        launch_queued(job_list);
 }
 
 /* 
@@ -572,17 +1242,11 @@ sigint_handler(int sig)
 {
     // 中断当前前台进程组
     int olderrno = errno;
-    pid_t pid;
     sigset_t mask_all, prev_all;
     Sigfillset(&mask_all);
     Sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
-    pid = fgpid(job_list);
-    if (pid != 0) {
-        Sigprocmask(SIG_SETMASK, &mask_all, &prev_all);
-        // 如果当前有前台进程，那么就中断它
-        Kill(-pid, sig);
-        fflush(stdout);
-    }
+    relay_signal(sig);
+    Sigprocmask(SIG_SETMASK, &prev_all, NULL);
     errno = olderrno;
     return;
 }
@@ -598,22 +1262,35 @@ sigtstp_handler(int sig)
     // trace 09 passed
     // 停止当前前台进程组
     int olderrno = errno;
-    pid_t pid;
     sigset_t mask_all, prev_all;
     Sigfillset(&mask_all);
     Sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
-
-    pid = fgpid(job_list);
-    if (pid != 0) {
-        Sigprocmask(SIG_SETMASK, &prev_all, NULL);
-        // 如果当前有前台进程，那么就停止它,而且应该是停止一个组的
-        Kill(-pid, sig);
-        fflush(stdout);
-    }
+    relay_signal(sig);
+    Sigprocmask(SIG_SETMASK, &prev_all, NULL);
     errno = olderrno;
     return;
 }
 
+/*
+ * relay_signal - Send sig (SIGINT or SIGTSTP) to the foreground job,
+ *     i.e. to its whole process group, if there is one. 没有前台作业时
+ *     的ctrl-c用来打断wait命令。
+ */
+void 
+relay_signal(int sig) 
+{
+    pid_t pid = fgpid(job_list); // O(1)，直接读前台作业的槽位
+    struct job_t *job;
+    long t0 = now_ns();
+
+    if (pid != 0 && (job = getjobpid(job_list, pid)) != NULL) {
+        signal_job(job, sig, 1);
+        hist_add(H_RELAY, now_ns() - t0);
+    }
+    else if (sig == SIGINT)
+        interrupted = 1;
+}
+
 /*
  * sigquit_handler - The driver program can gracefully terminate the
  *    child shell by sending it a SIGQUIT signal.
@@ -621,6 +1298,9 @@ sigtstp_handler(int sig)
 void 
 sigquit_handler(int sig) 
 {
+    if (!flushing)      // 主程序正在打印的话就不重复了
+        write_notices(0);
+    flush_log(1);
     sio_error("Terminating after receipt of SIGQUIT signal\n");
 }
 
@@ -630,474 +1310,2517 @@ sigquit_handler(int sig)
  * End signal handlers
  *********************/
 
-/***********************************************
- * Helper routines that manipulate the job list
- **********************************************/
+/****************************************
+ * Event loop (signalfd instead of handlers)
+ ****************************************/
 
-/* clearjob - Clear the entries in a job struct */
+/*
+ * init_events - 一直屏蔽SIGCHLD、SIGINT和SIGTSTP，改为从sig_fd里同步地
+ *     读出来。epoll_fd里是sig_fd和每个子进程的pidfd，stdin在wait_event
+ *     里单独等：普通文件不能加进epoll。
+ */
 void 
-clearjob(struct job_t *job) {
-    job->pid = 0;
-    job->jid = 0;
-    job->state = UNDEF;
-    job->cmdline[0] = '\0';
+init_events(void) 
+{
+    sigset_t mask;
+    struct epoll_event ev;
+
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGCHLD);
+    Sigaddset(&mask, SIGINT);
+    Sigaddset(&mask, SIGTSTP);
+    Sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    if ((sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+        unix_error("signalfd error");
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("epoll_create1 error");
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint32_t)sig_fd;   // 高32位是PID，sig_fd的是0
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sig_fd, &ev) < 0)
+        unix_error("epoll_ctl error");
 }
 
-/* initjobs - Initialize the job list */
-void 
-initjobs(struct job_t *job_list) {
-    int i;
+/*
+ * watch_pid - Open a pidfd for child pid. 事件循环模式下把它加进epoll_fd，
+ *     进程退出时pidfd变为可读。返回-1表示没有pidfd（内核太老），这个
+ *     进程只能靠waitpid(-1, ...)回收、靠kill发信号。
+ */
+int 
+watch_pid(pid_t pid) 
+{
+    struct epoll_event ev;
+    int fd;
 
-    for (i = 0; i < MAXJOBS; i++)
-        clearjob(&job_list[i]);
+    if ((fd = pidfd_open(pid, 0)) < 0) {
+        untracked++;
+        return -1;
+    }
+    if (event_mode) {
+        ev.events = EPOLLIN;
+        ev.data.u64 = ((uint64_t)pid << 32) | (uint32_t)fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            unix_error("epoll_ctl error");
+    }
+    return fd;
 }
 
-/* maxjid - Returns largest allocated job ID */
-int 
-maxjid(struct job_t *job_list) 
+/* 
+ * unwatch_pid - Close a pidfd from watch_pid. 显式地从epoll_fd里删掉：
+ *     还没exec的子进程可能也有这个描述符，close不一定会让它离开epoll。
+ */
+void 
+unwatch_pid(int fd) 
 {
-    int i, max=0;
-
-    for (i = 0; i < MAXJOBS; i++)
-        if (job_list[i].jid > max)
-            max = job_list[i].jid;
-    return max;
+    if (event_mode)
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
 }
 
-/* addjob - Add a job to the job list */
+/* siginfo_status - Convert the siginfo filled by waitid to a wait status */
 int 
-addjob(struct job_t *job_list, pid_t pid, int state, char *cmdline) 
+siginfo_status(const siginfo_t *info) 
 {
-    int i;
-
-    if (pid < 1)
-        return 0;
-
-    for (i = 0; i < MAXJOBS; i++) {
-        if (job_list[i].pid == 0) {
-            job_list[i].pid = pid;
-            job_list[i].state = state;
-            job_list[i].jid = nextjid++;
-            if (nextjid > MAXJOBS)
-                nextjid = 1;
-            strcpy(job_list[i].cmdline, cmdline);
-            if(verbose){
-                printf("Added job [%d] %d %s\n",
-                       job_list[i].jid,
-                       job_list[i].pid,
-                       job_list[i].cmdline);
-            }
-            return 1;
-        }
+    switch (info->si_code) {
+    case CLD_EXITED:
+        return (info->si_status & 0xff) << 8;
+    case CLD_KILLED:
+        return info->si_status & 0x7f;
+    case CLD_DUMPED:
+        return (info->si_status & 0x7f) | 0x80;
+    case CLD_STOPPED:
+    case CLD_TRAPPED:
+        return ((info->si_status & 0xff) << 8) | 0x7f;
+    default:    /* CLD_CONTINUED */
+        return 0xffff;
     }
-    printf("Tried to create too many jobs\n");
-    return 0;
 }
 
-/* deletejob - Delete a job whose PID=pid from the job list */
-int 
-deletejob(struct job_t *job_list, pid_t pid) 
+/*
+ * reap_pidfd - The pidfd of pid became readable: the process exited.
+ *     用waitid(P_PIDFD, ...)只回收这一个进程，不会碰到别的子进程。
+ */
+static void 
+reap_pidfd(pid_t pid, int fd) 
 {
-    int i;
+    siginfo_t info;
+    struct rusage ru;
 
-    if (pid < 1)
-        return 0;
+    // glibc的waitid没有rusage参数，直接用系统调用
+    info.si_pid = 0;
+    if (syscall(SYS_waitid, P_PIDFD, fd, &info, WEXITED | WNOHANG, &ru) < 0
+        || info.si_pid == 0)
+        return;
+    child_changed(pid, siginfo_status(&info), &ru);
+}
 
-    for (i = 0; i < MAXJOBS; i++) {
-        if (job_list[i].pid == pid) {
-            clearjob(&job_list[i]);
-            nextjid = maxjid(job_list)+1;
-            return 1;
+/*
+ * drain_signals - 读空sig_fd。SIGINT和SIGTSTP马上转发给前台作业，
+ *     SIGCHLD不管来了多少个，最后只调用一次reap_children。
+ */
+static void 
+drain_signals(void) 
+{
+    struct signalfd_siginfo info[16];
+    ssize_t n;
+    int i, reap = 0;
+
+    while ((n = read(sig_fd, info, sizeof(info))) > 0) {
+        for (i = 0; i < n / (ssize_t)sizeof(info[0]); i++) {
+            if (info[i].ssi_signo == SIGCHLD)
+                reap = 1;
+            else
+                relay_signal(info[i].ssi_signo);
         }
     }
-    return 0;
-}
-
-/* fgpid - Return PID of current foreground job, 0 if no such job */
-pid_t 
-fgpid(struct job_t *job_list) {
-    int i;
-
-    for (i = 0; i < MAXJOBS; i++)
-        if (job_list[i].state == FG)
-            return job_list[i].pid;
-    return 0;
-}
-
-/* getjobpid  - Find a job (by PID) on the job list */
-struct job_t 
-*getjobpid(struct job_t *job_list, pid_t pid) {
-    int i;
-
-    if (pid < 1)
-        return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-        if (job_list[i].pid == pid)
-            return &job_list[i];
-    return NULL;
+    if (n < 0 && errno != EAGAIN && errno != EINTR)
+        unix_error("signalfd read error");
+    if (reap)
+        reap_children();
 }
 
-/* getjobjid  - Find a job (by JID) on the job list */
-struct job_t *getjobjid(struct job_t *job_list, int jid) 
+/*
+ * dispatch_events - 一轮epoll_wait（最多等timeout毫秒），处理sig_fd和
+ *     变为可读的pidfd。
+ */
+static void 
+dispatch_events(int timeout) 
 {
-    int i;
-
-    if (jid < 1)
-        return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-        if (job_list[i].jid == jid)
-            return &job_list[i];
-    return NULL;
+    struct epoll_event ev[16];
+    int i, n;
+
+    while ((n = epoll_wait(epoll_fd, ev, 16, timeout)) < 0)
+        if (errno != EINTR)
+            unix_error("epoll_wait error");
+    for (i = 0; i < n; i++) {
+        if ((ev[i].data.u64 >> 32) != 0)
+            reap_pidfd((pid_t)(ev[i].data.u64 >> 32), (int)(uint32_t)ev[i].data.u64);
+        else if ((int)ev[i].data.u64 == sig_fd)
+            drain_signals();
+        else
+            serve_ctl((int)ev[i].data.u64);  // 控制socket或者它的连接
+    }
 }
 
-/* pid2jid - Map process ID to job ID */
+/*
+ * wait_event - Sleep until something happens and handle it. 
+ *     异步模式下就是sigsuspend，由信号处理程序完成工作；事件循环模式下
+ *     是一轮epoll，处理完sig_fd上的信号再返回。want_stdin非零的时候同时
+ *     等待stdin，stdin可读则返回1。返回之前打印攒下的通知。
+ */
 int 
-pid2jid(pid_t pid) 
+wait_event(int want_stdin) 
 {
-    int i;
-
-    if (pid < 1)
+    sigset_t mask;
+    struct pollfd pfd[2];
+    int timeout = -1;
+
+    if (!event_mode) {
+        Sigemptyset(&mask);
+        Sigsuspend(&mask);
+        flush_notices();
+        flush_log(0);
         return 0;
-    for (i = 0; i < MAXJOBS; i++)
-        if (job_list[i].pid == pid) {
-            return job_list[i].jid;
-        }
-    return 0;
-}
-
-/* listjobs - Print the job list */
-void 
-listjobs(struct job_t *job_list, int output_fd) // trace07 passed
-{
-    int i;
-    char buf[MAXLINE << 2];
-
-    for (i = 0; i < MAXJOBS; i++) {
-        memset(buf, '\0', MAXLINE);
-        if (job_list[i].pid != 0) {
-            sprintf(buf, "[%d] (%d) ", job_list[i].jid, job_list[i].pid);
-            if(write(output_fd, buf, strlen(buf)) < 0) {
-                fprintf(stderr, "Error writing to output file\n");
-                exit(1);
-            }
-            memset(buf, '\0', MAXLINE);
-            switch (job_list[i].state) {
-            case BG:
-                sprintf(buf, "Running    ");
-                break;
-            case FG:
-                sprintf(buf, "Foreground ");
-                break;
-            case ST:
-                sprintf(buf, "Stopped    ");
-                break;
-            default:
-                sprintf(buf, "listjobs: Internal error: job[%d].state=%d ",
-                        i, job_list[i].state);
-            }
-            if(write(output_fd, buf, strlen(buf)) < 0) {
-                fprintf(stderr, "Error writing to output file\n");
-                exit(1);
-            }
-            memset(buf, '\0', MAXLINE);
-            sprintf(buf, "%s\n", job_list[i].cmdline);
-            if(write(output_fd, buf, strlen(buf)) < 0) {
-                fprintf(stderr, "Error writing to output file\n");
-                exit(1);
-            }
-        }
     }
-}
-/******************************
- * end job list helper routines
- ******************************/
 
+    if (want_stdin) {
+        pfd[0].fd = epoll_fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = STDIN_FILENO;
+        pfd[1].events = POLLIN;
+        while (poll(pfd, 2, -1) < 0)
+            if (errno != EINTR)
+                unix_error("poll error");
+        if (!(pfd[0].revents & POLLIN))
+            return 1;
+        timeout = 0;
+    }
 
-/***********************
- * Other helper routines
- ***********************/
+    dispatch_events(timeout);
+    flush_notices();
+    flush_log(0);
+    return want_stdin && (pfd[1].revents != 0);
+}
 
-/*
- * usage - print a help message
- */
+/* poll_events - Handle whatever the event loop has pending, don't sleep */
 void 
-usage(void) 
+poll_events(void) 
 {
-    printf("Usage: shell [-hvp]\n");
-    printf("   -h   print this message\n");
-    printf("   -v   print additional diagnostic information\n");
-    printf("   -p   do not emit a command prompt\n");
-    exit(1);
+    dispatch_events(0);
 }
 
 /*
- * unix_error - unix-style error routine
+ * read_cmdline - fgets for the event loop. stdin用read(2)读进自己的缓冲区，
+ *     等待输入的时候照样处理信号。返回NULL表示EOF。
  */
-void 
-unix_error(char *msg)
+char *
+read_cmdline(char *buf, int size) 
 {
-    fprintf(stdout, "%s: %s\n", msg, strerror(errno));
-    exit(1);
+    static char in[MAXLINE * 4];
+    static int start, end, eof;
+    char *nl;
+    int len;
+    ssize_t n;
+
+    while (1) {
+        nl = memchr(in + start, '\n', end - start);
+        len = (nl != NULL) ? (int)(nl - (in + start)) + 1 : end - start;
+        if (nl != NULL || len >= size - 1 || (eof && len > 0)) {
+            if (len > size - 1)
+                len = size - 1;
+            memcpy(buf, in + start, len);
+            buf[len] = '\0';
+            start += len;
+            return buf;
+        }
+        if (eof)
+            return NULL;
+
+        // 没有完整的一行，把剩下的挪到开头再读
+        memmove(in, in + start, len);
+        start = 0;
+        end = len;
+        ctl_idle = 1;
+        while (!wait_event(1)) {
+            // 控制socket上的fg把作业调到了前台：等它结束或停止再读stdin
+            if (job_list->fg != 0) {
+                ctl_idle = 0;
+                waitfg(job_list->fg);
+                ctl_idle = 1;
+            }
+        }
+        ctl_idle = 0;
+        if ((n = read(STDIN_FILENO, in + end, sizeof(in) - end)) < 0) {
+            if (errno != EINTR)
+                unix_error("read error");
+        }
+        else if (n == 0)
+            eof = 1;
+        else
+            end += n;
+    }
 }
 
+/**************************************
+ * Control socket (-S)
+ **************************************/
+
 /*
- * app_error - application-style error routine
+ * open_unix_listenfd - Open and return a listening AF_UNIX stream socket
+ *     bound to path, like open_listenfd in csapp.c. 路径上已经有一个socket
+ *     （上次没有删掉）的话先删掉它；别的文件不动，bind会失败。
+ *
+ *     On error, returns -1 and sets errno.
  */
-void 
-app_error(char *msg)
+int 
+open_unix_listenfd(char *path) 
 {
-    fprintf(stdout, "%s\n", msg);
-    exit(1);
-}
+    struct sockaddr_un addr;
+    struct stat st;
+    int listenfd;
 
-/* Private sio_functions */
-/* sio_reverse - Reverse a string (from K&R) */
-static void sio_reverse(char s[])
-{
-    int c, i, j;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
 
-    for (i = 0, j = strlen(s)-1; i < j; i++, j--) {
-        c = s[i];
-        s[i] = s[j];
-        s[j] = c;
+    if ((listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(listenfd, LISTENQ) < 0) {
+        close(listenfd);
+        return -1;
     }
+    return listenfd;
 }
 
-/* sio_ltoa - Convert long to base b string (from K&R) */
-static void sio_ltoa(long v, char s[], int b) 
+/* Open_unix_listenfd - open_unix_listenfd的包装函数 */
+int 
+Open_unix_listenfd(char *path) 
 {
-    int c, i = 0;
-    
-    do {  
-        s[i++] = ((c = (v % b)) < 10)  ?  c + '0' : c - 10 + 'a';
-    } while ((v /= b) > 0);
-    s[i] = '\0';
-    sio_reverse(s);
+    int rc;
+
+    if ((rc = open_unix_listenfd(path)) < 0)
+        unix_error("Open_unix_listenfd error");
+    return rc;
 }
 
-/* sio_strlen - Return length of string (from K&R) */
-static size_t sio_strlen(const char s[])
+/* unlink_ctl - 退出时删掉控制socket */
+static void 
+unlink_ctl(void) 
 {
-    int i = 0;
-
-    while (s[i] != '\0')
-        ++i;
-    return i;
+    unlink(ctl_path);
 }
 
-/* sio_copy - Copy len chars from fmt to s (by Ding Rui) */
-void sio_copy(char *s, const char *fmt, size_t len)
+/* ctl_watch - 把fd加进epoll_fd，高32位是0，和sig_fd一样 */
+static void 
+ctl_watch(int fd) 
 {
-    if(!len)
-        return;
+    struct epoll_event ev;
 
-    for(size_t i = 0;i < len;i++)
-        s[i] = fmt[i];
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint32_t)fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        unix_error("epoll_ctl error");
 }
 
-/* Public Sio functions */
-ssize_t sio_puts(char s[]) /* Put string */
+/* init_ctl - 打开控制socket，交给事件循环 */
+void 
+init_ctl(char *path) 
 {
-    return write(STDOUT_FILENO, s, sio_strlen(s));
+    int i;
+
+    for (i = 0; i < CTLCLIENTS; i++)
+        ctl_clients[i].fd = -1;
+    ctl_fd = Open_unix_listenfd(path);
+    ctl_watch(ctl_fd);
+    atexit(unlink_ctl);
 }
 
-ssize_t sio_putl(long v) /* Put long */
+/* ctl_close - 断开一个连接 */
+static void 
+ctl_close(struct ctlclient_t *cl) 
 {
-    char s[128];
-    
-    sio_ltoa(v, s, 10); /* Based on K&R itoa() */ 
-    return sio_puts(s);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, cl->fd, NULL);
+    close(cl->fd);
+    cl->fd = -1;
 }
 
-ssize_t sio_put(const char *fmt, ...) // Put to the console. only understands %d
+/* json_str - 把s写成一个JSON字符串 */
+static void 
+json_str(FILE *fp, const char *s) 
 {
-  va_list ap;
-  char str[MAXLINE]; // formatted string
-  char arg[128];
-  const char *mess = "sio_put: Line too long!\n";
-  int i = 0, j = 0;
-  int sp = 0;
-  int v;
-
-  if (fmt == 0)
-    return -1;
-
-  va_start(ap, fmt);
-  while(fmt[j]){
-    if(fmt[j] != '%'){
-        j++;
-        continue;
+    fputc('"', fp);
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(fp, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(fp, "\\u%04x", *s);
+        else
+            fputc(*s, fp);
     }
+    fputc('"', fp);
+}
 
-    sio_copy(str + sp, fmt + i, j - i);
-    sp += j - i;
-
-    switch(fmt[j + 1]){
-    case 0:
-    		va_end(ap);
-        if(sp >= MAXLINE){
-            write(STDOUT_FILENO, mess, sio_strlen(mess));
-            return -1;
+/* ctl_list - list请求：整个作业表，每个作业带上还活着的进程 */
+static void 
+ctl_list(FILE *fp) 
+{
+    struct job_t *job;
+    struct jobent_t *ent;
+    struct timespec now;
+    struct timeval cpu;
+    int i = 0, j, first, njobs = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    chain_procs(job_list);
+    fprintf(fp, "{\"ok\":true,\"jobs\":[");
+    while ((job = nextjob(job_list, &i)) != NULL) {
+        fprintf(fp, "%s{\"jid\":%d,\"pid\":%d,\"state\":\"%s\",\"cmdline\":",
+                njobs++ ? "," : "", job->jid,
+                job->state == QUEUED ? 0 : job->pid, state_name(job->state));
+        json_str(fp, job->cmdline);
+        fprintf(fp, ",\"up_ms\":%ld",
+                (now.tv_sec - job->info->start.tv_sec) * 1000
+                + (now.tv_nsec - job->info->start.tv_nsec) / 1000000);
+        if (job->state != QUEUED) {
+            jobcpu(job_list, i - 1, job, &cpu);
+            fprintf(fp, ",\"cpu_ms\":%ld,\"stops\":%d,\"pids\":[",
+                    (long)cpu.tv_sec * 1000 + cpu.tv_usec / 1000, job->info->stops);
+            for (j = proc_first[i - 1], first = 1; j >= 0; j = proc_next[j]) {
+                ent = &job_list->pids.ent[j];
+                fprintf(fp, "%s%d", first ? "" : ",", ent->key);
+                first = 0;
+            }
+            fprintf(fp, "]");
         }
-        
-        str[sp] = 0;
-        return write(STDOUT_FILENO, str, sp);
-
-    case 'd':
-        v = va_arg(ap, int);
-        sio_ltoa(v, arg, 10);
-        sio_copy(str + sp, arg, sio_strlen(arg));
-        sp += sio_strlen(arg);
-        i = j + 2;
-        j = i;
-        break;
-
-    case '%':
-        sio_copy(str + sp, "%", 1);
-        sp += 1;
-        i = j + 2;
-        j = i;
-        break;
-
-    default:
-        sio_copy(str + sp, fmt + j, 2);
-        sp += 2;
-        i = j + 2;
-        j = i;
-        break;
+        fprintf(fp, "}");
     }
-  } // end while
-
-  sio_copy(str + sp, fmt + i, j - i);
-  sp += j - i;
-
-	va_end(ap);
-  if(sp >= MAXLINE){
-    write(STDOUT_FILENO, mess, sio_strlen(mess));
-    return -1;
-  }
-  
-  str[sp] = 0;
-  return write(STDOUT_FILENO, str, sp);
+    fprintf(fp, "]}\n");
 }
 
-void sio_error(char s[]) /* Put error message and exit */
+/* ctl_job - 按"%jid"或者"pid"找作业，找不到时往fp里写错误 */
+static struct job_t *
+ctl_job(FILE *fp, char *id) 
 {
-    sio_puts(s);
-    _exit(1);
+    struct job_t *job = NULL;
+
+    if (id == NULL)
+        fprintf(fp, "{\"ok\":false,\"error\":\"missing job id\"}\n");
+    else if ((job = (id[0] == '%') ? getjobjid(job_list, atoi(id + 1))
+                                   : getjobpid(job_list, atoi(id))) == NULL)
+        fprintf(fp, "{\"ok\":false,\"error\":\"no such job\"}\n");
+    return job;
 }
 
 /*
- * Signal - wrapper for the sigaction function
- */
-handler_t 
-*Signal(int signum, handler_t *handler) 
-{
-    struct sigaction action, old_action;
-
-    action.sa_handler = handler;  
-    sigemptyset(&action.sa_mask); /* block sigs of type being handled */
-    action.sa_flags = SA_RESTART; /* restart syscalls if possible */
-
-    if (sigaction(signum, &action, &old_action) < 0)
-        unix_error("Signal error");
-    return (old_action.sa_handler);
-}
-/*
- * Fork - fork函数的包装函数 
+ * ctl_request - 处理一个请求，回复写到fp：
+ *     list                  整个作业表
+ *     kill <id> [sig]       给作业的进程组发信号（默认SIGTERM）
+ *     bg <id> / fg <id>     和bg/fg命令一样，fg只在shell等待输入时可以
+ *     stats                 {"ok":true,"stats":stats --json的输出}
+ *     <id>是%jid或者pid。
  */
-pid_t Fork(void)
+static void 
+ctl_request(FILE *fp, char *line) 
 {
-    pid_t pid; // 书上介绍的Fork的错误处理包装函数
-    if((pid = fork()) < 0)
-        unix_error("Fork error");
-    return pid;
+    char *argv[4], *save;
+    struct job_t *job;
+    int argc = 0, sig;
+
+    for (argv[0] = strtok_r(line, " \t\r", &save); argv[argc] != NULL && argc < 3; )
+        argv[++argc] = strtok_r(NULL, " \t\r", &save);
+    argv[argc] = NULL;
+
+    if (argc == 0)
+        fprintf(fp, "{\"ok\":false,\"error\":\"empty request\"}\n");
+    else if (!strcmp(argv[0], "list"))
+        ctl_list(fp);
+    else if (!strcmp(argv[0], "stats")) {
+        fprintf(fp, "{\"ok\":true,\"stats\":");
+        print_stats(fp, 1);
+        fprintf(fp, "}\n");
+    }
+    else if (!strcmp(argv[0], "kill")) {
+        sig = (argv[1] != NULL && argv[2] != NULL) ? atoi(argv[2]) : SIGTERM;
+        if (sig < 1 || sig >= NSIG)
+            fprintf(fp, "{\"ok\":false,\"error\":\"bad signal\"}\n");
+        else if ((job = ctl_job(fp, argv[1])) != NULL) {
+            if (job->state == QUEUED)
+                drop_queued(job);
+            else
+                signal_job(job, sig, 1);
+            fprintf(fp, "{\"ok\":true,\"jid\":%d}\n", job->jid);
+        }
+    }
+    else if (!strcmp(argv[0], "bg") || !strcmp(argv[0], "fg")) {
+        if (argv[0][0] == 'f' && (!ctl_idle || job_list->fg != 0))
+            fprintf(fp, "{\"ok\":false,\"error\":\"shell is busy\"}\n");
+        else if ((job = ctl_job(fp, argv[1])) != NULL) {
+            if (job->state == QUEUED) {
+                if (argv[0][0] == 'f') {
+                    // 和fg命令一样插队启动；read_cmdline会等它
+                    unqueue_job(job_list, job);
+                    start_job(job_list, job, FG);
+                }
+            }
+            else {
+                setjobstate(job_list, job, argv[0][0] == 'f' ? FG : BG);
+                signal_job(job, SIGCONT, 1);
+            }
+            fprintf(fp, "{\"ok\":true,\"jid\":%d,\"state\":\"%s\"}\n",
+                    job->jid, state_name(job->state));
+        }
+    }
+    else
+        fprintf(fp, "{\"ok\":false,\"error\":\"unknown request\"}\n");
 }
 
 /*
- * builtin_cmd - 如果是内建命令，那么就直接执行，如果不是，那么就返回0
+ * serve_ctl - 控制socket上有事件：fd是监听socket就接受新连接，否则读
+ *     这个连接，处理里面完整的请求行。
  */
-int builtin_cmd(char **argv, struct cmdline_tokens * tok) // 书上介绍的判断是否是内建命令的函数
+void 
+serve_ctl(int fd) 
 {
-    if(!strcmp(argv[0], "quit")) // quit命令直接结束shell
-        exit(0); // trace01
-    else if(!strcmp(argv[0], "jobs")) {
-        // 重定向到文件中
-        if(tok->outfile != NULL) {
-            int fd_out = open(tok->outfile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-            if(fd_out < 0) {
-                printf("%s: No such file or directory\n", tok->outfile);
-                fflush(stdout);
-                return 1;
+    struct ctlclient_t *cl = NULL;
+    char *nl, *out = NULL;
+    size_t outlen = 0;
+    ssize_t n;
+    FILE *fp;
+    int i, conn;
+
+    if (fd == ctl_fd) {
+        while ((conn = accept4(ctl_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+            for (i = 0; i < CTLCLIENTS && ctl_clients[i].fd >= 0; i++)
+                ;
+            if (i == CTLCLIENTS) {  // 连接太多了
+                close(conn);
+                continue;
             }
-            // printf("fd_out: %d\n", fd_out);
-            listjobs(job_list, fd_out);
-            fflush(stdout);
-            close(fd_out);
-            // trace 23.24 passed
+            ctl_clients[i].fd = conn;
+            ctl_clients[i].len = 0;
+            ctl_watch(conn);
         }
-        else 
-            listjobs(job_list, STDOUT_FILENO); // 使用标准输出来输出所有的jobs
-        fflush(stdout);
-        // trace07 passed
-        return 1;
+        return;
     }
-    else if(!strcmp(argv[0], "bg") || !strcmp(argv[0], "fg")) {
-        conduct_bgfg(argv); // 这里面只可能会打印错误，我们不能把错误打印到文件中
-        return 1;
+
+    for (i = 0; i < CTLCLIENTS; i++)
+        if (ctl_clients[i].fd == fd)
+            cl = &ctl_clients[i];
+    if (cl == NULL)
+        return;
+    n = read(fd, cl->in + cl->len, sizeof(cl->in) - 1 - cl->len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0) {
+        ctl_close(cl);
+        return;
     }
-    else if(!strcmp(argv[0], "kill")) {
-        conduct_kill(argv);
-        return 1;
+    cl->len += n;
+    cl->in[cl->len] = '\0';
+
+    // 这一批请求的回复攒在一起，一次send
+    if ((fp = open_memstream(&out, &outlen)) == NULL)
+        unix_error("open_memstream error");
+    while ((nl = strchr(cl->in, '\n')) != NULL) {
+        *nl = '\0';
+        ctl_request(fp, cl->in);
+        cl->len -= nl + 1 - cl->in;
+        memmove(cl->in, nl + 1, cl->len + 1);
     }
-    else if(!strcmp(argv[0], "nohup")) {
-        // 只要对外部命令解决这个问题就好了
-        // 让跟在后面的命令忽略SIGHUP信号
-        Signal(SIGHUP, SIG_IGN);
-        return 1;
+    if (cl->len == (int)sizeof(cl->in) - 1) {
+        fprintf(fp, "{\"ok\":false,\"error\":\"request too long\"}\n");
+        cl->len = 0;
     }
-    else
-        return 0;
+    fclose(fp);
+    if (outlen > 0 && send(fd, out, outlen, MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)outlen)
+        ctl_close(cl);
+    free(out);
 }
 
-/*
- * Sigfillset - sigfillset函数的包装函数
- */
-void Sigfillset(sigset_t *set)
-{
-    if(sigfillset(set) < 0)
-        unix_error("Sigfillset error");
-    fflush(stdout);
-}
+/**************************************
+ * Batch input (-c string or script file)
+ **************************************/
 
 /*
- * Sigemptyset - sigemptyset函数的包装函数
+ * batch_open - Run commands from file, or from string if file is NULL, 
+ *     instead of stdin.
  */
-void Sigemptyset(sigset_t *set)
+void 
+batch_open(const char *file, const char *string) 
 {
-    if(sigemptyset(set) < 0)
-        unix_error("Sigemptyset error");
-    fflush(stdout);
+    batch.active = 1;
+    batch.fd = -1;
+    if (file != NULL) {
+        if ((batch.fd = open(file, O_RDONLY | O_CLOEXEC)) < 0) {
+            printf("%s: No such file or directory\n", file);
+            fflush(stdout);
+            exit(1);
+        }
+        return;
+    }
+    // -c：整个字符串就是唯一的一块
+    batch.len = strlen(string);
+    batch.cap = batch.len + 1;
+    if ((batch.buf = malloc(batch.cap)) == NULL)
+        unix_error("batch_open: malloc error");
+    memcpy(batch.buf, string, batch.len);
+    batch.eof = 1;
 }
 
-/*
- * Sigaddset - sigaddset函数的包装函数
- */
-void Sigaddset(sigset_t *set, int signum)
+/* batch_push - Queue the line at p (len bytes, already NUL-terminated) */
+static void 
+batch_push(char *p, size_t len) 
 {
-    if(sigaddset(set, signum) < 0)
-        unix_error("Sigaddset error");
-    fflush(stdout);
+    if (batch.count == batch.size) {
+        batch.size = batch.size ? batch.size * 2 : 1024;
+        if ((batch.line = realloc(batch.line, batch.size * sizeof(char *))) == NULL)
+            unix_error("batch_push: realloc error");
+    }
+    if (len > MAXLINE - 1)  // 和fgets(cmdline, MAXLINE, ...)一样截断
+        p[MAXLINE - 1] = '\0';
+    batch.line[batch.count++] = p;
 }
 
 /*
- * Sigprocmask - sigprocmask函数的包装函数
+ * batch_fill - 队列空了以后调用：把没读完的最后一行挪到开头，再读一块，
+ *     把其中完整的行都放进队列。返回队列里的行数，0表示读完了。
  */
-void Sigprocmask(int how, const sigset_t *set, sigset_t *oldset)
+static int 
+batch_fill(void) 
 {
-    if(sigprocmask(how, set, oldset) < 0)
-        unix_error("Sigprocmask error");
-    fflush(stdout);
+    char *p, *nl, *end;
+    ssize_t n;
+
+    batch.head = batch.count = 0;
+    if (batch.off > 0) {
+        memmove(batch.buf, batch.buf + batch.off, batch.len - batch.off);
+        batch.len -= batch.off;
+        batch.off = 0;
+    }
+
+    while (batch.count == 0 && !(batch.eof && batch.len == 0)) {
+        if (!batch.eof) {
+            if (batch.cap < batch.len + BATCHBLOCK + 1) {
+                batch.cap = batch.len + BATCHBLOCK + 1;
+                if ((batch.buf = realloc(batch.buf, batch.cap)) == NULL)
+                    unix_error("batch_fill: realloc error");
+            }
+            if ((n = read(batch.fd, batch.buf + batch.len, BATCHBLOCK)) < 0) {
+                if (errno == EINTR)
+                    continue;
+                unix_error("read error");
+            }
+            if (n == 0) {
+                batch.eof = 1;
+                close(batch.fd);
+                batch.fd = -1;
+            }
+            batch.len += n;
+        }
+
+        end = batch.buf + batch.len;
+        for (p = batch.buf + batch.off; (nl = memchr(p, '\n', end - p)) != NULL; p = nl + 1) {
+            *nl = '\0';
+            batch_push(p, nl - p);
+        }
+        if (batch.eof && p < end) {
+            // 最后一行没有换行符
+            *end = '\0';
+            batch_push(p, end - p);
+            p = end;
+        }
+        batch.off = p - batch.buf;
+        if (batch.eof && batch.count == 0)
+            batch.len = batch.off = 0;
+    }
+    return batch.count;
+}
+
+/* batch_next - Return the next command line, NULL at the end of input */
+char *
+batch_next(void) 
+{
+    if (batch.count == 0 && batch_fill() == 0)
+        return NULL;
+    batch.count--;
+    return batch.line[batch.head++];
+}
+
+/***********************************************
+ * Helper routines that manipulate the job list
+ **********************************************/
+
+/* clearjob - Clear the entries in a job struct */
+void 
+clearjob(struct job_t *job) {
+    job->pid = 0;
+    job->jid = 0;
+    job->state = UNDEF;
+    job->nprocs = 0;
+    job->lastpid = 0;
+    job->status = 0;
+    job->info = NULL;
+    job->spec = NULL;
+    job->qnext = NULL;
+    job->waiter = NULL;
+    job->cmdline = NULL;
+}
+
+/* initjobs - Initialize the job list */
+void 
+initjobs(struct joblist_t *job_list) {
+    job_list->slabs = NULL;
+    job_list->nslabs = 0;
+    job_list->njobs = 0;
+    job_list->hint = 0;
+    job_list->fg = 0;
+    job_list->running = 0;
+    job_list->qhead = job_list->qtail = NULL;
+    memset(job_list->jidmap, 0, sizeof(job_list->jidmap));
+    memset(job_list->jidany, 0, sizeof(job_list->jidany));
+    memset(job_list->jidfull, 0, sizeof(job_list->jidfull));
+    jobidx_init(&job_list->pids, JOBIDX_BITS);
+    jobidx_init(&job_list->jids, JOBIDX_BITS);
+}
+
+/* maxjid - Returns largest allocated job ID */
+int 
+maxjid(struct joblist_t *job_list) 
+{
+    int s, w;
+
+    for (s = JIDWORDS / 64 - 1; s >= 0; s--) {
+        if (job_list->jidany[s] != 0) {
+            w = s * 64 + 63 - __builtin_clzll(job_list->jidany[s]);
+            return w * 64 + 63 - __builtin_clzll(job_list->jidmap[w]) + 1;
+        }
+    }
+    return 0;
+}
+
+/* 
+ * allocjid - Allocate a job ID, 0 if all MAXJID IDs are in use
+ *
+ * 和参考实现一样，新的JID是当前最大JID加一；到了MAXJID以后
+ * 再从最小的空闲JID开始复用，这样不会和还在用的JID冲突。
+ */
+int 
+allocjid(struct joblist_t *job_list)
+{
+    int jid, s, w, b;
+
+    if ((jid = maxjid(job_list) + 1) > MAXJID) {
+        for (s = 0; s < JIDWORDS / 64; s++)
+            if (~job_list->jidfull[s] != 0)
+                break;
+        if (s == JIDWORDS / 64)
+            return 0;
+        w = s * 64 + __builtin_ctzll(~job_list->jidfull[s]);
+        jid = w * 64 + __builtin_ctzll(~job_list->jidmap[w]) + 1;
+    }
+
+    w = (jid - 1) / 64;
+    b = (jid - 1) % 64;
+    job_list->jidmap[w] |= (uint64_t)1 << b;
+    job_list->jidany[w / 64] |= (uint64_t)1 << (w % 64);
+    if (~job_list->jidmap[w] == 0)
+        job_list->jidfull[w / 64] |= (uint64_t)1 << (w % 64);
+    return jid;
+}
+
+/* freejid - Release a job ID allocated by allocjid */
+void 
+freejid(struct joblist_t *job_list, int jid)
+{
+    int w = (jid - 1) / 64, b = (jid - 1) % 64;
+
+    job_list->jidmap[w] &= ~((uint64_t)1 << b);
+    job_list->jidfull[w / 64] &= ~((uint64_t)1 << (w % 64));
+    if (job_list->jidmap[w] == 0)
+        job_list->jidany[w / 64] &= ~((uint64_t)1 << (w % 64));
+}
+
+/* 
+ * addjob - Add a job to the job list
+ *
+ * 可能要分配新的slab或者扩大索引，所以调用者必须屏蔽所有信号。
+ */
+int 
+addjob(struct joblist_t *job_list, pid_t pid, int state, char *cmdline) 
+{
+    struct job_t *job;
+
+    if (pid < 1)
+        return 0;
+    if ((job = newjob(job_list, UNDEF, cmdline)) == NULL)
+        return 0;
+    addjobpid(job_list, job, pid);
+    setjobstate(job_list, job, state);
+
+    if(verbose){
+        printf("Added job [%d] %d %s\n",
+               job->jid,
+               job->pid,
+               job->cmdline);
+    }
+    return 1;
+}
+
+/* 
+ * newjob - Allocate a job record with a JID but no process yet. 
+ *     Returns NULL if the job list is full. 调用者必须屏蔽所有信号。
+ */
+struct job_t *
+newjob(struct joblist_t *job_list, int state, char *cmdline) 
+{
+    int i, s, slot;
+    struct jobslab_t *slab, **slabs;
+    struct job_t *job;
+
+    if (job_list->njobs >= job_list->limit) {
+        printf("Tried to create too many jobs\n");
+        return NULL;
+    }
+
+    // 从hint开始找第一个还有空位的slab，找不到就在末尾新开一个
+    for (s = job_list->hint; s < job_list->nslabs; s++)
+        if (job_list->slabs[s] != NULL && ~job_list->slabs[s]->used != 0)
+            break;
+    if (s == job_list->nslabs) {
+        slabs = realloc(job_list->slabs, (s + 1) * sizeof(*slabs));
+        if (slabs == NULL)
+            unix_error("addjob: realloc error");
+        job_list->slabs = slabs;
+        job_list->slabs[s] = NULL;
+        job_list->nslabs++;
+    }
+    if ((slab = job_list->slabs[s]) == NULL) {
+        if ((slab = malloc(sizeof(*slab))) == NULL)
+            unix_error("addjob: malloc error");
+        slab->used = 0;
+        for (i = 0; i < JOBSLAB; i++)
+            clearjob(&slab->jobs[i]);
+        job_list->slabs[s] = slab;
+    }
+    job_list->hint = s;
+
+    i = __builtin_ctzll(~slab->used);
+    slab->used |= (uint64_t)1 << i;
+    slot = s * JOBSLAB + i;
+    job = &slab->jobs[i];
+    job_list->njobs++;
+
+    if ((job->info = arena_alloc(&str_arena, sizeof(*job->info))) == NULL)
+        app_error("newjob: jobinfo_t too large for the arena");
+    memset(job->info, 0, sizeof(*job->info));
+    clock_gettime(CLOCK_MONOTONIC, &job->info->start);
+    setjobstate(job_list, job, state);
+    job->jid = allocjid(job_list);
+    job_list->serial++;
+    job_list->newest = job->jid;
+    count_event(C_JOBS);
+    job->cmdline = arena_strdup(&str_arena, cmdline);
+    jobidx_insert(&job_list->jids, job->jid, slot);
+
+    // deletejob可能在信号处理程序里运行，不能free，所以空出来的slab在这里归还
+    while (job_list->nslabs > s + 1
+           && job_list->slabs[job_list->nslabs - 1] != NULL
+           && job_list->slabs[job_list->nslabs - 1]->used == 0) {
+        free(job_list->slabs[--job_list->nslabs]);
+    }
+    return job;
+}
+
+/* 
+ * addjobpid - Add a process to job. 第一个进程就是组长job->pid；它们都
+ *     放在PID索引里，这样信号处理程序能找到它属于哪个作业。
+ *     索引里预留了位置的话不会扩大索引，可以在信号处理程序里调用。
+ */
+int 
+addjobpid(struct joblist_t *job_list, struct job_t *job, pid_t pid)
+{
+    struct jobent_t *ent;
+
+    if (pid < 1)
+        return 0;
+    if (job->pid == 0)
+        job->pid = pid;
+    jobidx_insert(&job_list->pids, pid, jobidx_lookup(&job_list->jids, job->jid));
+    ent = jobidx_find(&job_list->pids, pid);
+    ent->fd = watch_pid(pid);
+    ent->live = 1;
+    count_event(C_PROCS);
+    job->lastpid = pid;
+    job->nprocs++;
+    return 1;
+}
+
+/* 
+ * deletejob - Delete process PID=pid from its job, and the job itself 
+ *     once every process of it has been reaped. Returns 1 if the job was 
+ *     deleted. 进程组组长的PID一直留在索引里直到作业删除：进程组还在
+ *     的时候内核不会把这个PID分配给别的进程。
+ */
+int 
+deletejob(struct joblist_t *job_list, pid_t pid) 
+{
+    struct job_t *job;
+    struct jobent_t *ent;
+
+    if (pid < 1)
+        return 0;
+
+    if ((ent = jobidx_find(&job_list->pids, pid)) == NULL)
+        return 0;
+    job = jobslot(job_list, ent->slot);
+    // 进程已经回收了，它的pidfd没用了（组长的索引项还要留着）
+    if (ent->fd >= 0)
+        unwatch_pid(ent->fd);
+    else
+        untracked--;
+    ent->fd = -1;
+    ent->live = 0;
+    if (pid != job->pid)
+        jobidx_remove(&job_list->pids, pid);
+    if (--job->nprocs > 0)
+        return 0;
+    freejob(job_list, job);
+    return 1;
+}
+
+/* 
+ * freejob - Remove job from the job list (its processes, if any, have 
+ *     all been reaped). 只释放arena里的块，异步信号安全。
+ */
+void 
+freejob(struct joblist_t *job_list, struct job_t *job) 
+{
+    int slot = jobidx_lookup(&job_list->jids, job->jid);
+
+    if (job->pid != 0)
+        jobidx_remove(&job_list->pids, job->pid);
+    jobidx_remove(&job_list->jids, job->jid);
+    freejid(job_list, job->jid);
+    arena_free(&str_arena, job->cmdline);
+    arena_free(&str_arena, job->info->pre.cpulist);
+    arena_free(&str_arena, job->info);
+    if (job->spec != NULL) {
+        job_list->pids.reserved -= job->spec->nstages;
+        arena_free(&str_arena, job->spec);
+    }
+    if (job->pid != 0 && job_list->fg == job->pid)
+        job_list->fg = 0;
+    if (job->state == BG)
+        job_list->running--;
+    if (job->waiter != NULL && job->waiter->status < 0) {   // wait -n只要第一个
+        job->waiter->jid = job->jid;
+        job->waiter->pid = job->pid;
+        job->waiter->status = job->status;
+    }
+    clearjob(job);
+    job_list->slabs[slot / JOBSLAB]->used &= ~((uint64_t)1 << (slot % JOBSLAB));
+    job_list->njobs--;
+    if (slot / JOBSLAB < job_list->hint)
+        job_list->hint = slot / JOBSLAB;
+}
+
+/* 
+ * signal_job - Send sig to the process group of job (group != 0) or to 
+ *     its first live process. 优先用组长的pidfd：PID被回收再分配以后也
+ *     不会发错进程。组长已经回收或者内核不支持的话退回到kill，进程组还在
+ *     的时候组ID不会被重用。失败返回-1，不会让shell退出。
+ */
+int 
+signal_job(struct job_t *job, int sig, int group)
+{
+    struct jobent_t *ent;
+
+    if (!group)
+        return signal_pid(job, live_stage(job), sig);
+    ent = jobidx_find(&job_list->pids, job->pid);
+    count_event(C_SIGNALS);
+    log_event("signal", -job->pid, job, "sig", sig);
+    if (ent != NULL && ent->fd >= 0
+        && pidfd_send_signal(ent->fd, sig, NULL, PIDFD_SIGNAL_PROCESS_GROUP) == 0)
+        return 0;
+    return kill(-job->pid, sig);
+}
+
+/*
+ * signal_pid - Send sig to process pid of job, through its own pidfd. 
+ *     这个进程已经回收了（作业里别的进程还在）就返回-1，errno是ESRCH。
+ */
+int 
+signal_pid(struct job_t *job, pid_t pid, int sig)
+{
+    struct jobent_t *ent = jobidx_find(&job_list->pids, pid);
+
+    count_event(C_SIGNALS);
+    log_event("signal", pid, job, "sig", sig);
+    if (ent == NULL || !ent->live) {
+        errno = ESRCH;
+        return -1;
+    }
+    if (ent->fd >= 0 && pidfd_send_signal(ent->fd, sig, NULL, 0) == 0)
+        return 0;
+    return kill(pid, sig);
+}
+
+/*
+ * live_stage - 作业里还没回收的第一个进程：通常就是组长，组长已经
+ *     回收了才扫描PID索引找同一个作业的其他进程。
+ */
+pid_t 
+live_stage(struct job_t *job)
+{
+    struct jobent_t *ent = jobidx_find(&job_list->pids, job->pid);
+    int i, slot;
+
+    if (ent != NULL && ent->live)
+        return job->pid;
+    slot = jobidx_lookup(&job_list->jids, job->jid);
+    for (i = 0; i < (1 << job_list->pids.bits); i++) {
+        ent = &job_list->pids.ent[i];
+        if (ent->key != 0 && ent->slot == slot && ent->live)
+            return ent->key;
+    }
+    return job->pid;
+}
+
+/* fgpid - Return PID of current foreground job, 0 if no such job */
+pid_t 
+fgpid(struct joblist_t *job_list) {
+    return job_list->fg;
+}
+
+/* 
+ * setjobstate - Change the state of a job. 所有的状态转换都经过这里，
+ *     顺便维护job_list->fg，这样fgpid不需要扫描作业表；jobs -l用的
+ *     状态改变时间和停止次数也在这里记。
+ */
+void 
+setjobstate(struct joblist_t *job_list, struct job_t *job, int state)
+{
+    if (state == FG)
+        job_list->fg = job->pid;
+    else if (job_list->fg == job->pid)
+        job_list->fg = 0;
+    if (state == ST && job->state != ST)
+        job->info->stops++;
+    if (job->state == BG)
+        job_list->running--;
+    if (state == BG)
+        job_list->running++;
+    if (state != job->state)
+        clock_gettime(CLOCK_MONOTONIC, &job->info->changed);  // 异步信号安全
+    job->state = state;
+}
+
+/* getjobpid  - Find a job (by PID) on the job list */
+struct job_t 
+*getjobpid(struct joblist_t *job_list, pid_t pid) {
+    int slot;
+
+    if (pid < 1)
+        return NULL;
+    if ((slot = jobidx_lookup(&job_list->pids, pid)) < 0)
+        return NULL;
+    return jobslot(job_list, slot);
+}
+
+/* getjobjid  - Find a job (by JID) on the job list */
+struct job_t *getjobjid(struct joblist_t *job_list, int jid) 
+{
+    int slot;
+
+    if (jid < 1)
+        return NULL;
+    if ((slot = jobidx_lookup(&job_list->jids, jid)) < 0)
+        return NULL;
+    return jobslot(job_list, slot);
+}
+
+/* pid2jid - Map process ID to job ID */
+int 
+pid2jid(pid_t pid) 
+{
+    struct job_t *job;
+
+    if ((job = getjobpid(job_list, pid)) == NULL)
+        return 0;
+    return job->jid;
+}
+
+/*
+ * chain_procs - 扫描一遍PID索引，把活着的进程按作业串起来：proc_first[slot]
+ *     是这个作业第一个进程在索引里的下标，proc_next[i]是同一个作业的下一个，
+ *     -1结尾，顺序和索引里一样。jobs -l和控制socket的list先调用它，之后每个
+ *     作业只看自己的进程，不用每个作业都扫一遍整个索引。调用者屏蔽SIGCHLD。
+ */
+static void 
+chain_procs(struct joblist_t *job_list)
+{
+    static int nfirst = 0, nnext = 0;
+    int i, n = 1 << job_list->pids.bits, slots = job_list->nslabs * JOBSLAB;
+    struct jobent_t *ent;
+
+    if (slots > nfirst) {
+        if ((proc_first = realloc(proc_first, slots * sizeof(int))) == NULL)
+            unix_error("chain_procs: realloc error");
+        nfirst = slots;
+    }
+    if (n > nnext) {
+        if ((proc_next = realloc(proc_next, n * sizeof(int))) == NULL)
+            unix_error("chain_procs: realloc error");
+        nnext = n;
+    }
+    memset(proc_first, 0xff, slots * sizeof(int));
+    for (i = n - 1; i >= 0; i--) {
+        ent = &job_list->pids.ent[i];
+        if (ent->key == 0 || !ent->live)
+            continue;
+        proc_next[i] = proc_first[ent->slot];
+        proc_first[ent->slot] = i;
+    }
+}
+
+/* 
+ * jobcpu - CPU time (user + sys) used by the job in slot so far: the 
+ *     processes already reaped, plus every live one. 活着的进程直接读
+ *     它的CPU时钟；读不到的话用最后一次停止/继续时记下的值。
+ *     先要调用chain_procs。
+ */
+static void 
+jobcpu(struct joblist_t *job_list, int slot, struct job_t *job, struct timeval *cpu)
+{
+    struct jobent_t *ent;
+    struct timespec ts;
+    struct timeval tv;
+    clockid_t cid;
+    int i;
+
+    timeradd(&job->info->ru.ru_utime, &job->info->ru.ru_stime, cpu);
+    for (i = proc_first[slot]; i >= 0; i = proc_next[i]) {
+        ent = &job_list->pids.ent[i];
+        if (clock_getcpuclockid(ent->key, &cid) == 0 && clock_gettime(cid, &ts) == 0) {
+            tv.tv_sec = ts.tv_sec;
+            tv.tv_usec = ts.tv_nsec / 1000;
+        }
+        else
+            tv = ent->cpu;
+        timeradd(cpu, &tv, cpu);
+    }
+}
+
+/* 
+ * listjobs - Print the job list
+ *
+ * 整个列表先格式化到一个复用的缓冲区里，最后只调用一次write，
+ * 而不是每个作业memset + sprintf + write三遍。long_fmt (jobs -l) 
+ * 还打印运行了多久、上次状态改变到现在多久、CPU时间和停止次数。
+ */
+void 
+listjobs(struct joblist_t *job_list, int output_fd, int long_fmt) // trace07 passed
+{
+    static char *buf = NULL;    /* reused across calls */
+    static size_t size = 0;
+    size_t len = 0, need;
+    ssize_t n;
+    int i = 0;
+    char *state, *p;
+    struct job_t *job;
+    sigset_t mask_one, prev_one;
+    struct timespec now;
+    struct timeval cpu;
+    struct jobinfo_t *info;
+    long up, since;     /* milliseconds */
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    // 遍历的时候不能让sigchld_handler删除作业
+    Sigemptyset(&mask_one);
+    Sigaddset(&mask_one, SIGCHLD);
+    Sigprocmask(SIG_BLOCK, &mask_one, &prev_one);
+    if (long_fmt)
+        chain_procs(job_list);
+    while ((job = nextjob(job_list, &i)) != NULL) {
+        // 只有jobs -l才去看jobinfo_t
+        info = long_fmt ? job->info : NULL;
+        need = len + strlen(job->cmdline) + 256;
+        if (info != NULL && info->pre.cpulist != NULL)
+            need += strlen(info->pre.cpulist);
+        if (need > size) {
+            size = need > 2 * size ? need : 2 * size;
+            if ((p = realloc(buf, size)) == NULL)
+                unix_error("listjobs: realloc error");
+            buf = p;
+        }
+        switch (job->state) {
+        case BG:
+            state = "Running    ";
+            break;
+        case FG:
+            state = "Foreground ";
+            break;
+        case ST:
+            state = "Stopped    ";
+            break;
+        case QUEUED:
+            state = "Queued     ";
+            break;
+        default:
+            len += sprintf(buf + len, "[%d] (%d) listjobs: Internal error: job[%d].state=%d %s\n",
+                           job->jid, job->pid, i - 1, job->state, job->cmdline);
+            continue;
+        }
+        if (job->state == QUEUED) {
+            len += sprintf(buf + len, "[%d] (-) %s%s\n", job->jid, state, job->cmdline);
+            continue;
+        }
+        if (!long_fmt) {
+            len += sprintf(buf + len, "[%d] (%d) %s%s\n",
+                           job->jid, job->pid, state, job->cmdline);
+            continue;
+        }
+        up = (now.tv_sec - info->start.tv_sec) * 1000
+             + (now.tv_nsec - info->start.tv_nsec) / 1000000;
+        since = (now.tv_sec - info->changed.tv_sec) * 1000
+                + (now.tv_nsec - info->changed.tv_nsec) / 1000000;
+        jobcpu(job_list, i - 1, job, &cpu);
+        len += sprintf(buf + len, "[%d] (%d) %sup %ld.%03lds  changed %ld.%03lds ago  "
+                       "cpu %ld.%03lds  stops %d  ",
+                       job->jid, job->pid, state, up / 1000, up % 1000,
+                       since / 1000, since % 1000, (long)cpu.tv_sec,
+                       (long)cpu.tv_usec / 1000, info->stops);
+        if (info->pre.cpulist != NULL)
+            len += sprintf(buf + len, "cpus %s  ", info->pre.cpulist);
+        if (info->pre.niced)
+            len += sprintf(buf + len, "nice %d  ", info->pre.nice);
+        if (info->pre.lim.mem || info->pre.lim.cpu || info->pre.lim.files) {
+            len += sprintf(buf + len, "limit");
+            if (info->pre.lim.mem)
+                len += sprintf(buf + len, " mem=%lluK", (unsigned long long)info->pre.lim.mem >> 10);
+            if (info->pre.lim.cpu)
+                len += sprintf(buf + len, " cpu=%llus", (unsigned long long)info->pre.lim.cpu);
+            if (info->pre.lim.files)
+                len += sprintf(buf + len, " files=%llu", (unsigned long long)info->pre.lim.files);
+            len += sprintf(buf + len, "  ");
+        }
+        len += sprintf(buf + len, "%s\n", job->cmdline);
+    }
+    Sigprocmask(SIG_SETMASK, &prev_one, NULL);
+
+    for (p = buf; len > 0; p += n, len -= n) {
+        if ((n = write(output_fd, p, len)) < 0) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            fprintf(stderr, "Error writing to output file\n");
+            exit(1);
+        }
+    }
+}
+
+/* jobslot - Return the job record in slot */
+struct job_t 
+*jobslot(struct joblist_t *job_list, int slot)
+{
+    return &job_list->slabs[slot / JOBSLAB]->jobs[slot % JOBSLAB];
+}
+
+/* 
+ * nextjob - Return the first live job at or after *slot and advance
+ *     *slot past it, NULL when there are no more jobs. Start with *slot = 0.
+ */
+struct job_t 
+*nextjob(struct joblist_t *job_list, int *slot)
+{
+    int s = *slot / JOBSLAB;
+    uint64_t bits;
+    struct jobslab_t *slab;
+
+    for (; s < job_list->nslabs; s++) {
+        if ((slab = job_list->slabs[s]) == NULL)
+            continue;
+        bits = slab->used;
+        if (s == *slot / JOBSLAB)  // 跳过当前slab里已经看过的记录
+            bits &= ~(uint64_t)0 << (*slot % JOBSLAB);
+        if (bits != 0) {
+            *slot = s * JOBSLAB + __builtin_ctzll(bits) + 1;
+            return &slab->jobs[*slot - 1 - s * JOBSLAB];
+        }
+    }
+    *slot = job_list->nslabs * JOBSLAB;
+    return NULL;
+}
+
+/* jobidx_home - Home bucket of key (Fibonacci hashing) */
+static inline int 
+jobidx_home(struct jobidx_t *index, int key)
+{
+    return (int)(((unsigned)key * 2654435761u) >> (32 - index->bits));
+}
+
+/* jobidx_init - Allocate an empty index with 1 << bits entries */
+void 
+jobidx_init(struct jobidx_t *index, int bits)
+{
+    if ((index->ent = calloc((size_t)1 << bits, sizeof(struct jobent_t))) == NULL)
+        unix_error("jobidx_init: calloc error");
+    index->bits = bits;
+    index->count = 0;
+    index->reserved = 0;
+}
+
+/* jobidx_probe - Return the entry of key, or the empty entry it would take */
+static struct jobent_t *
+jobidx_probe(struct jobidx_t *index, int key)
+{
+    int mask = (1 << index->bits) - 1;
+    int i = jobidx_home(index, key);
+
+    while (index->ent[i].key != 0 && index->ent[i].key != key)
+        i = (i + 1) & mask;
+    return &index->ent[i];
+}
+
+/* jobidx_grow - Double the size of index (calls malloc) */
+static void 
+jobidx_grow(struct jobidx_t *index)
+{
+    int i;
+    struct jobidx_t old = *index;
+
+    jobidx_init(index, old.bits + 1);
+    index->reserved = old.reserved;
+    index->count = old.count;
+    for (i = 0; i < (1 << old.bits); i++)
+        if (old.ent[i].key != 0)
+            *jobidx_probe(index, old.ent[i].key) = old.ent[i];
+    free(old.ent);
+}
+
+/* 
+ * jobidx_reserve - Make room for n more keys, so that inserting them 
+ *     (after giving back the reservation) never has to grow the index.
+ *     排队作业出队时在信号处理程序里插入PID，用的就是这里预留的位置。
+ */
+void 
+jobidx_reserve(struct jobidx_t *index, int n)
+{
+    index->reserved += n;
+    while ((index->count + index->reserved) * 2 > (1 << index->bits))
+        jobidx_grow(index);
+}
+
+/* 
+ * jobidx_insert - Map key to slot in index
+ *
+ * 装载率超过1/2时扩大一倍，只在主程序屏蔽信号时调用；用的是
+ * jobidx_reserve预留的位置的话不会扩大，信号处理程序里也可以调用。
+ */
+void 
+jobidx_insert(struct jobidx_t *index, int key, int slot)
+{
+    struct jobent_t *ent;
+
+    while ((index->count + index->reserved + 1) * 2 > (1 << index->bits))
+        jobidx_grow(index);
+
+    ent = jobidx_probe(index, key);
+    if (ent->key == 0)
+        index->count++;
+    ent->key = key;
+    ent->slot = slot;
+    ent->fd = -1;
+    ent->live = 0;
+    timerclear(&ent->cpu);
+}
+
+/* 
+ * jobidx_find - Return the entry of key, NULL if none. 指针在下一次
+ *     插入或删除之前有效。
+ */
+struct jobent_t *
+jobidx_find(struct jobidx_t *index, int key)
+{
+    int mask = (1 << index->bits) - 1;
+    int i = jobidx_home(index, key);
+
+    while (index->ent[i].key != 0) {
+        if (index->ent[i].key == key)
+            return &index->ent[i];
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+/* jobidx_lookup - Return the slot mapped to key, -1 if none */
+int 
+jobidx_lookup(struct jobidx_t *index, int key)
+{
+    struct jobent_t *ent = jobidx_find(index, key);
+
+    return (ent != NULL) ? ent->slot : -1;
+}
+
+/* jobidx_remove - Remove key from index */
+void 
+jobidx_remove(struct jobidx_t *index, int key)
+{
+    int mask = (1 << index->bits) - 1;
+    int i = jobidx_home(index, key), j, k;
+    struct jobent_t *ent = index->ent;
+
+    while (ent[i].key != key) {
+        if (ent[i].key == 0)
+            return;
+        i = (i + 1) & mask;
+    }
+    // backward shift：把后面同一探测链上的元素往前挪，填上空洞
+    for (j = i; ; ) {
+        j = (j + 1) & mask;
+        if (ent[j].key == 0)
+            break;
+        k = jobidx_home(index, ent[j].key);
+        // k 在 (i, j] 之间（循环意义下）的元素不能挪到i之前
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        ent[i] = ent[j];
+        i = j;
+    }
+    ent[i].key = 0;
+    index->count--;
+}
+
+/* 
+ * arena_alloc - Allocate size bytes from the arena
+ *
+ * 只在主程序屏蔽信号时调用。块头记录大小类，实际可用
+ * (16 << cls) - sizeof(struct arenablk_t) 字节。
+ */
+void 
+*arena_alloc(struct arena_t *arena, size_t size)
+{
+    int cls = 0;
+    size_t need = size + sizeof(struct arenablk_t);
+    struct arenablk_t *blk;
+
+    while ((size_t)16 << cls < need)
+        if (++cls == ARENACLASSES)
+            return NULL;
+    need = (size_t)16 << cls;
+
+    if ((blk = arena->free[cls]) != NULL) {
+        arena->free[cls] = blk->next;
+    }
+    else {
+        if (arena->bump == NULL || (size_t)(arena->end - arena->bump) < need) {
+            // 当前chunk剩下的一点不要了，直接换一个新的
+            if ((arena->bump = malloc(ARENACHUNK)) == NULL)
+                unix_error("arena_alloc: malloc error");
+            arena->end = arena->bump + ARENACHUNK;
+        }
+        blk = (struct arenablk_t *)arena->bump;
+        arena->bump += need;
+    }
+    blk->cls = cls;
+    return blk + 1;
+}
+
+/* arena_free - Return a block to its size class (async-signal-safe) */
+void 
+arena_free(struct arena_t *arena, void *p)
+{
+    struct arenablk_t *blk;
+
+    if (p == NULL)
+        return;
+    blk = (struct arenablk_t *)p - 1;
+    blk->next = arena->free[blk->cls];
+    arena->free[blk->cls] = blk;
+}
+
+/* arena_strdup - Copy s into the arena */
+char 
+*arena_strdup(struct arena_t *arena, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *p;
+
+    if ((p = arena_alloc(arena, len)) == NULL)
+        app_error("arena_strdup: string too long");
+    memcpy(p, s, len);
+    return p;
+}
+/******************************
+ * end job list helper routines
+ ******************************/
+
+
+/**************************************
+ * Command hash (cached PATH search)
+ **************************************/
+
+/* cmdcache_home - Home bucket of a command name (FNV-1a) */
+static int 
+cmdcache_home(struct cmdcache_t *cache, const char *name)
+{
+    unsigned h = 2166136261u;
+
+    while (*name)
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    return (int)((h * 2654435761u) >> (32 - cache->bits));
+}
+
+/* cmdcache_clear - Forget every resolved command (hash -r) */
+void 
+cmdcache_clear(struct cmdcache_t *cache)
+{
+    int i;
+
+    for (i = 0; cache->ent != NULL && i < (1 << cache->bits); i++) {
+        if (cache->ent[i] != NULL) {
+            free(cache->ent[i]->name);
+            free(cache->ent[i]->path);
+            free(cache->ent[i]);
+            cache->ent[i] = NULL;
+        }
+    }
+    cache->count = 0;
+}
+
+/* 
+ * cmdcache_setpath - Open every directory in path and remember its mtime.
+ *     Directories that do not exist get fd -1 and are skipped.
+ */
+static void 
+cmdcache_setpath(struct cmdcache_t *cache, const char *path)
+{
+    int i;
+    const char *p, *q;
+    char dir[MAXLINE];
+    struct stat st;
+
+    for (i = 0; i < cache->ndirs; i++) {
+        if (cache->dirs[i].fd >= 0)
+            close(cache->dirs[i].fd);
+        free(cache->dirs[i].dir);
+    }
+    free(cache->dirs);
+    free(cache->path);
+    cmdcache_clear(cache);
+
+    if ((cache->path = strdup(path)) == NULL)
+        unix_error("cmdcache_setpath: strdup error");
+    for (cache->ndirs = 1, p = path; *p; p++)
+        if (*p == ':')
+            cache->ndirs++;
+    if ((cache->dirs = calloc(cache->ndirs, sizeof(struct pathdir_t))) == NULL)
+        unix_error("cmdcache_setpath: calloc error");
+
+    for (i = 0, p = path; i < cache->ndirs; i++, p = q + 1) {
+        if ((q = strchr(p, ':')) == NULL)
+            q = p + strlen(p);
+        // 空的PATH元素表示当前目录
+        snprintf(dir, sizeof(dir), "%.*s", q == p ? 1 : (int)(q - p), q == p ? "." : p);
+        if ((cache->dirs[i].dir = strdup(dir)) == NULL)
+            unix_error("cmdcache_setpath: strdup error");
+        cache->dirs[i].fd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (cache->dirs[i].fd >= 0 && fstat(cache->dirs[i].fd, &st) == 0)
+            cache->dirs[i].mtime = st.st_mtim;
+    }
+}
+
+/* 
+ * cmdcache_stale - Return 1 if any of PATH directories 0..last changed
+ *     since the cache was filled
+ */
+static int 
+cmdcache_stale(struct cmdcache_t *cache, int last)
+{
+    int i;
+    struct stat st;
+
+    for (i = 0; i <= last; i++) {
+        if (cache->dirs[i].fd < 0)
+            continue;
+        if (fstat(cache->dirs[i].fd, &st) < 0
+            || st.st_mtim.tv_sec != cache->dirs[i].mtime.tv_sec
+            || st.st_mtim.tv_nsec != cache->dirs[i].mtime.tv_nsec)
+            return 1;
+    }
+    return 0;
+}
+
+/* cmdcache_insert - Add a resolved command, growing the table at 1/2 load */
+static struct cmdent_t 
+*cmdcache_insert(struct cmdcache_t *cache, const char *name, const char *path, int dir)
+{
+    int i;
+    struct cmdent_t **old, *ent;
+    int oldbits = cache->bits;
+
+    if (cache->ent == NULL || (cache->count + 1) * 2 > (1 << cache->bits)) {
+        old = cache->ent;
+        cache->bits = old == NULL ? CMDHASH_BITS : oldbits + 1;
+        if ((cache->ent = calloc((size_t)1 << cache->bits, sizeof(*cache->ent))) == NULL)
+            unix_error("cmdcache_insert: calloc error");
+        for (i = 0; old != NULL && i < (1 << oldbits); i++) {
+            if (old[i] == NULL)
+                continue;
+            int j = cmdcache_home(cache, old[i]->name);
+            while (cache->ent[j] != NULL)
+                j = (j + 1) & ((1 << cache->bits) - 1);
+            cache->ent[j] = old[i];
+        }
+        free(old);
+    }
+
+    if ((ent = malloc(sizeof(*ent))) == NULL
+        || (ent->name = strdup(name)) == NULL
+        || (ent->path = strdup(path)) == NULL)
+        unix_error("cmdcache_insert: malloc error");
+    ent->dir = dir;
+    ent->hits = 0;
+    i = cmdcache_home(cache, name);
+    while (cache->ent[i] != NULL)
+        i = (i + 1) & ((1 << cache->bits) - 1);
+    cache->ent[i] = ent;
+    cache->count++;
+    return ent;
+}
+
+/* cmdcache_lookup - Find the cache entry for name, NULL if none */
+static struct cmdent_t 
+*cmdcache_lookup(struct cmdcache_t *cache, const char *name)
+{
+    int i;
+
+    if (cache->ent == NULL)
+        return NULL;
+    for (i = cmdcache_home(cache, name); cache->ent[i] != NULL;
+         i = (i + 1) & ((1 << cache->bits) - 1))
+        if (!strcmp(cache->ent[i]->name, name))
+            return cache->ent[i];
+    return NULL;
+}
+
+/* 
+ * resolve_cmd - Return the file to execute for command name, NULL if it
+ *     is not in PATH. Names containing a '/' are returned unchanged.
+ */
+const char 
+*resolve_cmd(const char *name)
+{
+    const char *path;
+    char file[MAXLINE];
+    struct cmdent_t *ent;
+    struct stat st;
+    int i;
+
+    if (strchr(name, '/') != NULL)
+        return name;
+
+    if ((path = getenv("PATH")) == NULL)
+        path = "/bin:/usr/bin";
+    if (cmd_cache.path == NULL || strcmp(cmd_cache.path, path))
+        cmdcache_setpath(&cmd_cache, path);
+
+    if ((ent = cmdcache_lookup(&cmd_cache, name)) != NULL) {
+        if (!cmdcache_stale(&cmd_cache, ent->dir)) {
+            ent->hits++;
+            return ent->path;
+        }
+        // 有目录变了：丢掉整个缓存，重新记录所有目录的mtime
+        cmdcache_setpath(&cmd_cache, path);
+    }
+
+    for (i = 0; i < cmd_cache.ndirs; i++) {
+        if (cmd_cache.dirs[i].fd < 0)
+            continue;
+        if (fstatat(cmd_cache.dirs[i].fd, name, &st, 0) == 0 && S_ISREG(st.st_mode)
+            && faccessat(cmd_cache.dirs[i].fd, name, X_OK, AT_EACCESS) == 0) {
+            snprintf(file, sizeof(file), "%s/%s", cmd_cache.dirs[i].dir, name);
+            ent = cmdcache_insert(&cmd_cache, name, file, i);
+            ent->hits++;
+            return ent->path;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * conduct_hash - 执行hash命令
+ * hash: 列出缓存的命令；hash -r: 清空缓存；hash name...: 查找并加入缓存
+ */
+void conduct_hash(char **argv)
+{
+    int i;
+    struct cmdent_t *ent;
+
+    if (argv[1] == NULL) {
+        if (cmd_cache.count == 0) {
+            printf("hash: hash table empty\n");
+        }
+        else {
+            printf("hits\tcommand\n");
+            for (i = 0; i < (1 << cmd_cache.bits); i++)
+                if ((ent = cmd_cache.ent[i]) != NULL)
+                    printf("%4d\t%s\n", ent->hits, ent->path);
+        }
+    }
+    else if (!strcmp(argv[1], "-r")) {
+        cmdcache_clear(&cmd_cache);
+    }
+    else {
+        for (i = 1; argv[i] != NULL; i++) {
+            if (strchr(argv[i], '/') != NULL)
+                continue;
+            if (resolve_cmd(argv[i]) == NULL)
+                printf("hash: %s: not found\n", argv[i]);
+            else if ((ent = cmdcache_lookup(&cmd_cache, argv[i])) != NULL)
+                ent->hits--; // 只是加入缓存，不算一次使用
+        }
+    }
+    fflush(stdout);
+}
+
+
+/***********************
+ * Other helper routines
+ ***********************/
+
+/*
+ * usage - print a help message
+ */
+void 
+usage(void) 
+{
+    printf("Usage: shell [-hvpE] [-n <jobs>] [-j <running>] [-e fork|spawn] [-L <file>] [-S <socket>] [-c <commands> | <script>]\n");
+    printf("   -h   print this message\n");
+    printf("   -v   print additional diagnostic information\n");
+    printf("   -p   do not emit a command prompt\n");
+    printf("   -n   max number of jobs (default $TSH_MAXJOBS or 16)\n");
+    printf("   -j   max running background jobs, the rest are queued (setmax)\n");
+    printf("   -e   how to start commands (default $TSH_LAUNCH or fork)\n");
+    printf("   -E   handle signals in a signalfd event loop ($TSH_EVENTS)\n");
+    printf("   -c   run the commands in the string, one per line, and exit\n");
+    printf("   -L   append job lifecycle events to the file, one JSON object per line\n");
+    printf("   -S   serve list/kill/fg/bg/stats requests on a unix socket (implies -E)\n");
+    exit(1);
+}
+
+/*
+ * unix_error - unix-style error routine
+ */
+void 
+unix_error(char *msg)
+{
+    fprintf(stdout, "%s: %s\n", msg, strerror(errno));
+    exit(1);
+}
+
+/*
+ * app_error - application-style error routine
+ */
+void 
+app_error(char *msg)
+{
+    fprintf(stdout, "%s\n", msg);
+    exit(1);
+}
+
+/* Private sio_functions */
+/* sio_digits - "00"到"99"连在一起，十进制转换一次查表写两位 */
+static const char sio_digits[] =
+    "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+    "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+/*
+ * sio_utoa - Convert v to base b (10 or 16) backwards, so that the last 
+ *     digit is just before end. Returns the first digit. 十进制每次除以
+ *     100，不用先倒着写再sio_reverse，也不用再strlen。
+ */
+static char *sio_utoa(unsigned long v, char *end, int b)
+{
+    char *p = end;
+    unsigned long q;
+    int r;
+
+    if (b == 16) {
+        do {
+            *--p = "0123456789abcdef"[v & 0xf];
+        } while ((v >>= 4) != 0);
+        return p;
+    }
+    while (v >= 100) {
+        q = v / 100;
+        r = (int)(v - q * 100) * 2;
+        p -= 2;
+        p[0] = sio_digits[r];
+        p[1] = sio_digits[r + 1];
+        v = q;
+    }
+    if (v >= 10) {
+        p -= 2;
+        p[0] = sio_digits[v * 2];
+        p[1] = sio_digits[v * 2 + 1];
+    }
+    else
+        *--p = '0' + v;
+    return p;
+}
+
+/* sio_strlen - Return length of string (from K&R) */
+static size_t sio_strlen(const char s[])
+{
+    int i = 0;
+
+    while (s[i] != '\0')
+        ++i;
+    return i;
+}
+
+/* sio_copy - Copy len chars from fmt to s (by Ding Rui) */
+void sio_copy(char *s, const char *fmt, size_t len)
+{
+    if(!len)
+        return;
+
+    for(size_t i = 0;i < len;i++)
+        s[i] = fmt[i];
+}
+
+/*
+ * sio_vformat - 异步信号安全的格式化：把fmt格式化到buf里（最多size个
+ *     字节，不加'\0'），认识%d %ld %u %lu %x %lx %s %c %%，不认识的原样
+ *     输出。返回长度，放不下返回-1。
+ */
+static ssize_t sio_vformat(char *buf, size_t size, const char *fmt, va_list ap)
+{
+    char num[24], *end = num + sizeof(num);
+    const char *s;
+    size_t n = 0, len;
+    unsigned long u;
+    long v;
+    int lng;
+    char *p;
+
+    for (; *fmt != '\0'; fmt++) {
+        if (*fmt != '%') {
+            if (n == size)
+                return -1;
+            buf[n++] = *fmt;
+            continue;
+        }
+        lng = (fmt[1] == 'l');
+        fmt += 1 + lng;
+        switch (*fmt) {
+        case 'd':
+            v = lng ? va_arg(ap, long) : va_arg(ap, int);
+            u = (v < 0) ? -(unsigned long)v : (unsigned long)v;
+            p = sio_utoa(u, end, 10);
+            if (v < 0)
+                *--p = '-';
+            s = p;
+            len = end - p;
+            break;
+        case 'u':
+        case 'x':
+            u = lng ? va_arg(ap, unsigned long) : va_arg(ap, unsigned);
+            s = sio_utoa(u, end, (*fmt == 'x') ? 16 : 10);
+            len = end - s;
+            break;
+        case 's':
+            if ((s = va_arg(ap, const char *)) == NULL)
+                s = "(null)";
+            len = sio_strlen(s);
+            break;
+        case 'c':
+            num[0] = (char)va_arg(ap, int);
+            s = num;
+            len = 1;
+            break;
+        case '\0':      // 结尾孤零零的一个'%'
+            fmt--;
+            /* fall through */
+        case '%':
+            s = "%";
+            len = 1;
+            break;
+        default:
+            s = fmt - 1 - lng;
+            len = 2 + lng;
+            break;
+        }
+        if (len > size - n)
+            return -1;
+        sio_copy(buf + n, s, len);
+        n += len;
+    }
+    return n;
+}
+
+/* sio_format - Format into buf like sio_put, without writing it */
+ssize_t sio_format(char *buf, size_t size, const char *fmt, ...)
+{
+    va_list ap;
+    ssize_t n;
+
+    va_start(ap, fmt);
+    n = sio_vformat(buf, size, fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+/* Public Sio functions */
+ssize_t sio_puts(char s[]) /* Put string */
+{
+    return write(STDOUT_FILENO, s, sio_strlen(s));
+}
+
+ssize_t sio_putl(long v) /* Put long */
+{
+    return sio_put("%ld", v);
+}
+
+/*
+ * sio_put - Put a formatted line to the console. 整行先在栈上拼好再一次
+ *     write，几个进程（或者信号处理程序和主程序）同时输出也不会交错。
+ */
+ssize_t sio_put(const char *fmt, ...)
+{
+    va_list ap;
+    char str[MAXLINE]; // formatted string
+    const char *mess = "sio_put: Line too long!\n";
+    ssize_t n;
+
+    if (fmt == NULL)
+        return -1;
+    va_start(ap, fmt);
+    n = sio_vformat(str, sizeof(str), fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        write(STDOUT_FILENO, mess, sio_strlen(mess));
+        return -1;
+    }
+    return write(STDOUT_FILENO, str, n);
+}
+
+void sio_error(char s[]) /* Put error message and exit */
+{
+    sio_puts(s);
+    _exit(1);
+}
+
+/*
+ * notice_fmt - 把一条通知格式化到p，返回结尾（异步信号安全）。调用者
+ *     给了NOTICE_MAX个字节，启动通知里有整个命令行。
+ */
+static char *notice_fmt(char *p, const struct notice_t *n)
+{
+    if (n->kind == NOTICE_START)
+        return p + sio_format(p, NOTICE_MAX, "[%d] (%d) %s\n",
+                              n->jid, n->pid, n->spec->cmdline);
+    return p + sio_format(p, NOTICE_MAX, "Job [%d] (%d) %s by signal %d%s\n",
+                          n->jid, n->pid,
+                          (n->kind == NOTICE_TERM) ? "terminated" : "stopped",
+                          n->sig,
+                          (n->flags & NOTICE_CPULIMIT) ? " (cpu limit exceeded)" : "");
+}
+
+/*
+ * push_notice - 生产者：记一条作业通知。只有几次赋值；环满了（主程序
+ *     很久没有打印）才直接write这一条。NOTICE_START的记录接管job->spec，
+ *     打印以后由消费者释放。
+ */
+void push_notice(int kind, struct job_t *job, int sig, int flags)
+{
+    unsigned tail = notice_tail;
+    struct notice_t *n, one;
+    char line[NOTICE_MAX];
+
+    if (tail - __atomic_load_n(&notice_head, __ATOMIC_ACQUIRE) == NOTICES) {
+        one.kind = kind;
+        one.flags = flags;
+        one.sig = sig;
+        one.jid = job->jid;
+        one.pid = job->pid;
+        one.spec = job->spec;
+        write(STDOUT_FILENO, line, notice_fmt(line, &one) - line);
+        if (kind == NOTICE_START)   // 调用者屏蔽了所有信号
+            arena_free(&str_arena, job->spec);
+        return;
+    }
+    n = &notices[tail & (NOTICES - 1)];
+    n->kind = kind;
+    n->flags = flags;
+    n->sig = sig;
+    n->jid = job->jid;
+    n->pid = job->pid;
+    n->spec = (kind == NOTICE_START) ? job->spec : NULL;
+    n->t_ns = now_ns();
+    __atomic_store_n(&notice_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * write_notices - 消费者：把环里的通知格式化到一个缓冲区，整批write。
+ *     只在主程序里调用，还有退出之前的sigquit_handler（异步信号安全）。
+ *     release非零时释放启动通知的spec，只有主程序这样调用。
+ */
+static void write_notices(int release)
+{
+    static char buf[16 << 10];
+    unsigned head = notice_head, tail, i;
+    char *p = buf;
+    long now;
+    sigset_t mask_all, prev_all;
+
+    tail = __atomic_load_n(&notice_tail, __ATOMIC_ACQUIRE);
+    if (head == tail)
+        return;
+    flushing = 1;
+    for (; head != tail; head++) {
+        if (p - buf > (long)sizeof(buf) - NOTICE_MAX) {
+            write(STDOUT_FILENO, buf, p - buf);
+            p = buf;
+        }
+        p = notice_fmt(p, &notices[head & (NOTICES - 1)]);
+    }
+    write(STDOUT_FILENO, buf, p - buf);
+    now = now_ns();
+    for (i = notice_head; i != tail; i++)
+        hist_add(H_NOTICE, now - notices[i & (NOTICES - 1)].t_ns);
+    if (release) {
+        // arena_free不能被信号处理程序里的arena_free打断
+        sigfillset(&mask_all);
+        sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+        for (i = notice_head; i != tail; i++)
+            if (notices[i & (NOTICES - 1)].kind == NOTICE_START)
+                arena_free(&str_arena, notices[i & (NOTICES - 1)].spec);
+        sigprocmask(SIG_SETMASK, &prev_all, NULL);
+    }
+    __atomic_store_n(&notice_head, head, __ATOMIC_RELEASE);
+    flushing = 0;
+}
+
+/* flush_notices - 主程序打印通知，先把printf缓冲区写出去，保持顺序 */
+void flush_notices(void)
+{
+    if (notice_head == __atomic_load_n(&notice_tail, __ATOMIC_ACQUIRE))
+        return;
+    fflush(stdout);
+    write_notices(1);
+}
+
+/* state_name - 作业状态的名字，写日志用 */
+static const char *state_name(int state)
+{
+    switch (state) {
+    case FG:
+        return "FG";
+    case BG:
+        return "BG";
+    case ST:
+        return "ST";
+    case QUEUED:
+        return "QUEUED";
+    default:
+        return "UNDEF";
+    }
+}
+
+/*
+ * log_event - 往-L日志里记一个事件：pid（信号发给进程组时是负的）、
+ *     所属的作业job（可以是NULL），key不是NULL的话再加一个整数字段。
+ *     异步信号安全：缓冲区满了就丢掉，下次flush_log时报告丢了多少条。
+ */
+void log_event(const char *event, pid_t pid, struct job_t *job, const char *key, long val)
+{
+    char rec[256];
+    struct timespec now;
+    unsigned word, at, cur;
+    ssize_t n, m = 0;
+
+    if (log_fd < 0)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    n = sio_format(rec, sizeof(rec),
+                   "{\"t_ns\":%ld,\"event\":\"%s\",\"pid\":%d,\"jid\":%d,\"state\":\"%s\"",
+                   (long)now.tv_sec * 1000000000L + now.tv_nsec, event, pid,
+                   job ? job->jid : 0, job ? state_name(job->state) : "-");
+    if (key != NULL)
+        m = sio_format(rec + n, sizeof(rec) - n - 2, ",\"%s\":%ld", key, val);
+    n += m;
+    rec[n++] = '}';
+    rec[n++] = '\n';
+
+    word = __atomic_fetch_add(&log_word, (unsigned)n, __ATOMIC_SEQ_CST);
+    cur = (word & LOGCUR) ? 1 : 0;
+    at = word & ~LOGCUR;
+    if (at + n > LOGBUF) {
+        // 放不下：记住有效数据到哪里为止（最早放不下的那条的位置）
+        if (log_full[cur] == 0 || at < log_full[cur])
+            log_full[cur] = at;
+        __atomic_fetch_add(&log_dropped, 1, __ATOMIC_SEQ_CST);
+        return;
+    }
+    sio_copy(log_bufs[cur] + at, rec, n);
+}
+
+/* log_write - write all of buf to the log file */
+static void log_write(const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(log_fd, buf, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;     // 日志写不进去不影响shell本身
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/*
+ * flush_log - 把日志缓冲区写到文件里。force为0时攒到半满才写，这样负载
+ *     高的时候也是大块写。在主程序里调用；sigquit_handler退出之前也调用
+ *     一次（主程序这时如果正在log_event里，最后一条可能不完整）。
+ */
+void flush_log(int force)
+{
+    unsigned word, len, cur, dropped;
+    char rec[128];
+    ssize_t n;
+
+    if (log_fd < 0)
+        return;
+    word = __atomic_load_n(&log_word, __ATOMIC_SEQ_CST);
+    if (!force && (word & ~LOGCUR) < LOGBUF / 2
+        && __atomic_load_n(&log_dropped, __ATOMIC_SEQ_CST) == 0)
+        return;
+
+    // 换到另一个缓冲区；之后的记录都写到那边，这个缓冲区可以慢慢写
+    word = __atomic_exchange_n(&log_word, (word & LOGCUR) ^ LOGCUR, __ATOMIC_SEQ_CST);
+    cur = (word & LOGCUR) ? 1 : 0;
+    len = word & ~LOGCUR;
+    if (log_full[cur] != 0) {
+        len = log_full[cur];
+        log_full[cur] = 0;
+    }
+    log_write(log_bufs[cur], len);
+
+    if ((dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_SEQ_CST)) > 0) {
+        n = sio_format(rec, sizeof(rec), "{\"event\":\"dropped\",\"count\":%u}\n", dropped);
+        log_write(rec, n);
+    }
+}
+
+/* flush_log_all - atexit: write out everything that is still buffered */
+static void flush_log_all(void)
+{
+    flush_log(1);
+}
+
+/*
+ * Signal - wrapper for the sigaction function
+ */
+handler_t 
+*Signal(int signum, handler_t *handler) 
+{
+    struct sigaction action, old_action;
+
+    action.sa_handler = handler;  
+    sigemptyset(&action.sa_mask); /* block sigs of type being handled */
+    action.sa_flags = SA_RESTART; /* restart syscalls if possible */
+
+    if (sigaction(signum, &action, &old_action) < 0)
+        unix_error("Signal error");
+    return (old_action.sa_handler);
+}
+/*
+ * Fork - fork函数的包装函数 
+ */
+pid_t Fork(void)
+{
+    pid_t pid; // 书上介绍的Fork的错误处理包装函数
+    if((pid = fork()) < 0)
+        unix_error("Fork error");
+    return pid;
+}
+
+/*
+ * parse_engine - 根据名字设置launch_engine，名字不认识返回-1
+ */
+int parse_engine(const char *name)
+{
+    if (!strcmp(name, "fork"))
+        launch_engine = LAUNCH_FORK;
+    else if (!strcmp(name, "spawn"))
+        launch_engine = LAUNCH_SPAWN;
+    else
+        return -1;
+    return 0;
+}
+
+/*
+ * parse_cpulist - 把"2-5"、"0,3,8-11"这样的CPU列表解析到set里，
+ *     格式不对或者CPU编号太大返回-1
+ */
+static int parse_cpulist(const char *list, cpu_set_t *set)
+{
+    long lo, hi;
+    char *end;
+
+    CPU_ZERO(set);
+    do {
+        if (!isdigit((unsigned char)*list))
+            return -1;
+        lo = hi = strtol(list, &end, 10);
+        if (*end == '-') {
+            if (!isdigit((unsigned char)end[1]))
+                return -1;
+            hi = strtol(end + 1, &end, 10);
+        }
+        if (lo > hi || hi >= CPU_SETSIZE)
+            return -1;
+        for (; lo <= hi; lo++)
+            CPU_SET(lo, set);
+        list = end + 1;
+    } while (*end == ',');
+    return (*end == '\0') ? 0 : -1;
+}
+
+/*
+ * parse_limit - 解析limit前缀的一项：mem=N[K|M|G]、cpu=N[s]或files=N，
+ *     格式不对返回-1
+ */
+static int parse_limit(const char *arg, struct joblimit_t *lim)
+{
+    const char *val = strchr(arg, '=');
+    unsigned long long n;
+    char *end;
+
+    if (val == NULL || !isdigit((unsigned char)val[1]))
+        return -1;
+    n = strtoull(val + 1, &end, 10);
+    if (!strncmp(arg, "mem=", 4)) {
+        switch (*end) {
+        case 'G': case 'g': n <<= 10; /* fall through */
+        case 'M': case 'm': n <<= 10; /* fall through */
+        case 'K': case 'k': n <<= 10; end++;
+        }
+        if (*end != '\0' || n == 0)
+            return -1;
+        lim->mem = n;
+    }
+    else if (!strncmp(arg, "cpu=", 4) && (*end == '\0' || !strcmp(end, "s")) && n > 0)
+        lim->cpu = n;
+    else if (!strncmp(arg, "files=", 6) && *end == '\0' && n > 0)
+        lim->files = n;
+    else
+        return -1;
+    return 0;
+}
+
+/*
+ * parse_prefix - 处理命令前面的time、cpus LIST、nice N和limit前缀，顺序随意，
+ *     每个最多一次。tok->stage[0]改成真正的命令。前缀写错了或者后面
+ *     没有命令（比如只有time，或者time后面直接是'|'）返回-1。
+ */
+int parse_prefix(struct cmdline_tokens *tok, struct jobprefix_t *pre)
+{
+    char **argv = tok->argv, *end;
+    int i = 0;
+
+    memset(pre, 0, sizeof(*pre));
+    while (argv[i] != NULL) {
+        if (!strcmp(argv[i], "time") && !pre->timed) {
+            pre->timed = 1;
+            i++;
+        }
+        else if (!strcmp(argv[i], "cpus") && !pre->pinned) {
+            if (argv[i + 1] == NULL || parse_cpulist(argv[i + 1], &pre->cpus) < 0) {
+                printf("cpus: invalid CPU list %s\n", argv[i + 1] ? argv[i + 1] : "");
+                fflush(stdout);
+                return -1;
+            }
+            pre->pinned = 1;
+            pre->cpulist = argv[i + 1];
+            i += 2;
+        }
+        else if (!strcmp(argv[i], "nice") && !pre->niced) {
+            if (argv[i + 1] == NULL
+                || (pre->nice = strtol(argv[i + 1], &end, 10), *end != '\0' || end == argv[i + 1])
+                || pre->nice < -20 || pre->nice > 19) {
+                printf("nice: invalid nice value %s\n", argv[i + 1] ? argv[i + 1] : "");
+                fflush(stdout);
+                return -1;
+            }
+            pre->niced = 1;
+            i += 2;
+        }
+        else if (!strcmp(argv[i], "limit") && !pre->limited) {
+            // limit后面跟一个或几个key=value
+            for (i++; argv[i] != NULL && strchr(argv[i], '=') != NULL; i++) {
+                if (parse_limit(argv[i], &pre->lim) < 0) {
+                    printf("limit: invalid limit %s\n", argv[i]);
+                    fflush(stdout);
+                    return -1;
+                }
+                pre->limited = 1;
+            }
+            if (!pre->limited) {
+                printf("limit: expected mem=, cpu= or files=\n");
+                fflush(stdout);
+                return -1;
+            }
+        }
+        else
+            break;
+    }
+    if (argv[i] == NULL || i >= tok->argc)
+        return -1;
+    tok->stage[0] = i;
+    return 0;
+}
+
+/* set_prefix - 把前缀记到作业里，jobs -l要显示（只在主程序里调用） */
+void set_prefix(struct job_t *job, struct jobprefix_t *pre)
+{
+    job->info->pre = *pre;
+    // cpulist指向parseline的缓冲区，复制一份给jobs -l
+    job->info->pre.cpulist = pre->pinned ? arena_strdup(&str_arena, pre->cpulist) : NULL;
+}
+
+/*
+ * set_limit - 把资源res的软限制设成val。硬限制设成val + slack，但不超过
+ *     原来的硬限制（普通用户不能提高硬限制）。val为0就不用管。
+ */
+static int set_limit(int res, rlim_t val, rlim_t slack)
+{
+    struct rlimit rl;
+
+    if (val == 0)
+        return 0;
+    if (getrlimit(res, &rl) < 0)
+        return -1;
+    if (rl.rlim_max == RLIM_INFINITY || val + slack < rl.rlim_max)
+        rl.rlim_max = val + slack;
+    rl.rlim_cur = (val < rl.rlim_max) ? val : rl.rlim_max;
+    return setrlimit(res, &rl);
+}
+
+/*
+ * apply_prefix - 在子进程里、execve之前设置CPU亲和性、nice值和资源限制。
+ *     CPU时间的硬限制比软限制多1秒：先收到SIGXCPU，不理它的话再被SIGKILL。
+ *     失败返回-1；只用系统调用和sio，start_job的子进程也能用。
+ */
+int apply_prefix(const struct jobprefix_t *pre)
+{
+    if (pre->pinned && sched_setaffinity(0, sizeof(pre->cpus), &pre->cpus) < 0) {
+        sio_puts("cpus: cannot set CPU affinity\n");
+        return -1;
+    }
+    if (pre->niced && setpriority(PRIO_PROCESS, 0, pre->nice) < 0) {
+        sio_puts("nice: cannot set nice value\n");
+        return -1;
+    }
+    if (set_limit(RLIMIT_AS, pre->lim.mem, 0) < 0
+        || set_limit(RLIMIT_CPU, pre->lim.cpu, 1) < 0
+        || set_limit(RLIMIT_NOFILE, pre->lim.files, 0) < 0) {
+        sio_puts("limit: cannot set resource limit\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * launch_stage - 启动管道里的一个命令，返回子进程的PID，失败返回0
+ *
+ * path是要执行的程序，argv是它的参数；子进程加入进程组pgid
+ * （0表示用自己的PID新建一个），fd_in/fd_out不是-1的话dup2到0/1，
+ * 信号屏蔽字恢复成child_mask。fd_in/fd_out应该是O_CLOEXEC的，
+ * exec以后只剩下dup2出来的0和1。
+ *
+ * LAUNCH_FORK: fork以后子进程自己setpgid、dup2、execve。
+ * LAUNCH_SPAWN: 进程组和重定向都交给spawn属性和file actions。glibc的
+ * posix_spawn内部用的是clone(CLONE_VM|CLONE_VFORK)，不需要复制页表。
+ * spawn属性里没有CPU亲和性、nice值和资源限制，有这些前缀的命令还是用fork。
+ */
+pid_t launch_stage(const char *path, char **argv, pid_t pgid, int fd_in, int fd_out,
+                   const sigset_t *child_mask, const struct jobprefix_t *pre)
+{
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    pid_t pid = 0;
+
+    fflush(stdout); // 不要让子进程的输出跑到缓冲区里的内容前面
+
+    if (launch_engine == LAUNCH_FORK || pre->pinned || pre->niced || pre->limited) {
+        if ((pid = Fork()) == 0) {
+            // 当前是在子进程里了
+            Sigprocmask(SIG_SETMASK, child_mask, NULL);  // 解除屏蔽
+
+            // 设置子进程的进程组
+            // After the fork, but before the execve, the child process should call
+            // setpgid(0, 0), which puts the child in a new process group whose group ID is identical to the
+            // child’s PID. This ensures that there will be only one process, your shell, in the foreground process
+            // group. 管道里后面的命令加入第一个命令的进程组。
+            setpgid(0, pgid);
+            if (apply_prefix(pre) < 0)  // cpus、nice和limit前缀
+                _exit(1);
+
+            // 从重定向的文件（或者管道）中读取输入
+            if (fd_in != -1)
+                Dup2(fd_in, STDIN_FILENO);
+            // 将输出重定向到文件（或者管道）中
+            if (fd_out != -1)
+                Dup2(fd_out, STDOUT_FILENO);
+
+            // 执行命令
+            Execve(path, argv, environ);
+            _exit(0);
+        }
+        // 父进程也设置一次子进程的进程组，这样不管谁先运行，
+        // addjob之后kill(-pid, ...)都能找到这个进程组。
+        // 子进程已经exec的话会返回EACCES，那时它自己已经设置好了
+        setpgid(pid, pgid ? pgid : pid);
+        return pid;
+    }
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    posix_spawnattr_setsigmask(&attr, child_mask);
+    posix_spawn_file_actions_init(&actions);
+    if (fd_in != -1)
+        posix_spawn_file_actions_adddup2(&actions, fd_in, STDIN_FILENO);
+    if (fd_out != -1)
+        posix_spawn_file_actions_adddup2(&actions, fd_out, STDOUT_FILENO);
+
+    if (posix_spawn(&pid, path, &actions, &attr, argv, environ) != 0) {
+        printf("%s: Command not found\n", argv[0]);
+        fflush(stdout);
+        pid = 0;
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    return pid;
+}
+
+/*
+ * builtin_cmd - 如果是内建命令，那么就直接执行，如果不是，那么就返回0
+ */
+int builtin_cmd(char **argv, struct cmdline_tokens * tok) // 书上介绍的判断是否是内建命令的函数
+{
+    if(!strcmp(argv[0], "quit")) // quit命令直接结束shell
+        exit(0); // trace01
+    else if(!strcmp(argv[0], "jobs")) {
+        int long_fmt = (argv[1] != NULL && !strcmp(argv[1], "-l"));  // jobs -l
+        // 重定向到文件中
+        if(tok->outfile != NULL) {
+            int fd_out = open(tok->outfile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+            if(fd_out < 0) {
+                printf("%s: No such file or directory\n", tok->outfile);
+                fflush(stdout);
+                return 1;
+            }
+            // printf("fd_out: %d\n", fd_out);
+            listjobs(job_list, fd_out, long_fmt);
+            fflush(stdout);
+            close(fd_out);
+            // trace 23.24 passed
+        }
+        else 
+            listjobs(job_list, STDOUT_FILENO, long_fmt); // 使用标准输出来输出所有的jobs
+        fflush(stdout);
+        // trace07 passed
+        return 1;
+    }
+    else if(!strcmp(argv[0], "bg") || !strcmp(argv[0], "fg")) {
+        conduct_bgfg(argv); // 这里面只可能会打印错误，我们不能把错误打印到文件中
+        return 1;
+    }
+    else if(!strcmp(argv[0], "kill")) {
+        conduct_kill(argv);
+        return 1;
+    }
+    else if(!strcmp(argv[0], "hash")) {
+        conduct_hash(argv);
+        return 1;
+    }
+    else if(!strcmp(argv[0], "setmax")) {
+        conduct_setmax(argv);
+        return 1;
+    }
+    else if(!strcmp(argv[0], "wait")) {
+        conduct_wait(argv);
+        return 1;
+    }
+    else if(!strcmp(argv[0], "parallel")) {
+        conduct_parallel(argv, tok);
+        return 1;
+    }
+    else if(!strcmp(argv[0], "stats")) {
+        conduct_stats(argv);
+        return 1;
+    }
+    else if(!strcmp(argv[0], "nohup")) {
+        // 只要对外部命令解决这个问题就好了
+        // 让跟在后面的命令忽略SIGHUP信号
+        Signal(SIGHUP, SIG_IGN);
+        return 1;
+    }
+    else
+        return 0;
+}
+
+/*
+ * Sigfillset - sigfillset函数的包装函数
+ */
+void Sigfillset(sigset_t *set)
+{
+    if(sigfillset(set) < 0)
+        unix_error("Sigfillset error");
+}
+
+/*
+ * Sigemptyset - sigemptyset函数的包装函数
+ */
+void Sigemptyset(sigset_t *set)
+{
+    if(sigemptyset(set) < 0)
+        unix_error("Sigemptyset error");
+}
+
+/*
+ * Sigaddset - sigaddset函数的包装函数
+ */
+void Sigaddset(sigset_t *set, int signum)
+{
+    if(sigaddset(set, signum) < 0)
+        unix_error("Sigaddset error");
+}
+
+/*
+ * Sigprocmask - sigprocmask函数的包装函数
+ */
+void Sigprocmask(int how, const sigset_t *set, sigset_t *oldset)
+{
+    if(sigprocmask(how, set, oldset) < 0)
+        unix_error("Sigprocmask error");
 }
 
 /*
@@ -1108,7 +3831,6 @@ void Sigsuspend(const sigset_t *mask)
     // write(STDOUT_FILENO, "sigsuspend\n", 11);
     if(sigsuspend(mask) != -1)
         unix_error("Sigsuspend error");
-    fflush(stdout);
 }
 
 /*
@@ -1119,7 +3841,6 @@ int Kill(pid_t pid, int signum)
     int success;
     if((success = kill(pid, signum)) < 0)
         unix_error("Kill error");
-    fflush(stdout);
     return success;
 }
 
@@ -1141,16 +3862,48 @@ void Execve(const char *filename, char *const argv[], char *const envp[])
  */
 void waitfg(pid_t pid)
 {
-    sigset_t mask_all;
-    Sigemptyset(&mask_all);
-    while(fgpid(job_list) != 0)
-        Sigsuspend(&mask_all);
+    // job_list->fg由setjobstate/deletejob维护，每次醒来只读一个字段
+    while(job_list->fg != 0)
+        wait_event(0);
     // write(STDOUT_FILENO, "waitfg finished\n", 16);
     fflush(stdout);
     return;
 }
 
 
+/*
+ * report_times - 打印已经结束的`time`作业的资源使用情况。前台作业在
+ *     waitfg返回以后马上打印；后台作业在它结束以后的下一条命令之后打印。
+ */
+void report_times(void)
+{
+    struct timereport_t reports[MAXREPORTS], *r;
+    sigset_t mask_one, prev_one;
+    int i, n;
+
+    if (nreports == 0)
+        return;
+    Sigemptyset(&mask_one);
+    Sigaddset(&mask_one, SIGCHLD);
+    Sigprocmask(SIG_BLOCK, &mask_one, &prev_one);
+    n = nreports;
+    memcpy(reports, time_reports, n * sizeof(reports[0]));
+    nreports = 0;
+    Sigprocmask(SIG_SETMASK, &prev_one, NULL);
+
+    for (i = 0; i < n; i++) {
+        r = &reports[i];
+        printf("[%d] (%d) real %ld.%03lds user %ld.%03lds sys %ld.%03lds\n",
+               r->jid, r->pid,
+               (long)r->real.tv_sec, r->real.tv_nsec / 1000000,
+               (long)r->ru.ru_utime.tv_sec, (long)r->ru.ru_utime.tv_usec / 1000,
+               (long)r->ru.ru_stime.tv_sec, (long)r->ru.ru_stime.tv_usec / 1000);
+        printf("[%d] (%d) maxrss %ldKB, %ld voluntary and %ld involuntary context switches\n",
+               r->jid, r->pid, r->ru.ru_maxrss, r->ru.ru_nvcsw, r->ru.ru_nivcsw);
+    }
+    fflush(stdout);
+}
+
 /*
  * conduct_bgfg - 执行bg和fg命令。
  * bg(pid) or bg(%jid) 这个命令需要先修改属性，然后发送SIGCONT信号
@@ -1162,6 +3915,15 @@ void conduct_bgfg(char **argv) {
     // 同时通过发送SIGCONT信号来恢复进程组，也就是一个job，但是给的表示这个job的参数不同
     struct job_t *job;
     char *id = argv[1]; // id是一个字符串，到底是JID还是PID
+    sigset_t mask_all, prev_all, mask_one;
+    pid_t pid;
+
+    // 查找、改状态和发信号的时候屏蔽所有信号：不能让sigchld_handler在中间
+    // 把作业删掉，或者和setjobstate同时改running
+    Sigfillset(&mask_all);
+    Sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+    mask_one = prev_all;
+    Sigaddset(&mask_one, SIGCHLD);  // 和eval一样，屏蔽着SIGCHLD进入waitfg
     if (id[0] == '%') {
         // JID
         int jid = atoi(id + 1);
@@ -1169,37 +3931,60 @@ void conduct_bgfg(char **argv) {
         if (job == NULL) {
             printf("%s: No such job\n", id);
             fflush(stdout);
+            Sigprocmask(SIG_SETMASK, &prev_all, NULL);
             return;
         }
     }
     else {
         // PID
-        pid_t pid = atoi(id);
+        pid = atoi(id);
         job = getjobpid(job_list, pid);
         if (job == NULL) {
             printf("(%s): No such process\n", id);
             fflush(stdout);
+            Sigprocmask(SIG_SETMASK, &prev_all, NULL);
             return;
         }
     }
 
+    // 还在排队的作业：bg什么也不做，fg让它插队在前台启动
+    if (job->state == QUEUED) {
+        if (!strcmp(argv[0], "bg")) {
+            printf("[%d] (queued) %s\n", job->jid, job->cmdline);
+            fflush(stdout);
+        }
+        else {
+            unqueue_job(job_list, job);
+            if (start_job(job_list, job, FG)) {
+                pid = job->pid;
+                Sigprocmask(SIG_SETMASK, &mask_one, NULL);
+                waitfg(pid);
+            }
+        }
+        Sigprocmask(SIG_SETMASK, &prev_all, NULL);
+        return;
+    }
+
     // 如果是bg命令，那么就把job的状态改为BG
     if (!strcmp(argv[0], "bg")) {
-        job->state = BG;
+        setjobstate(job_list, job, BG);
         printf("[%d] (%d) %s\n", job->jid, job->pid, job->cmdline);
         fflush(stdout);
         // 使用kill发送信号
-        Kill(-(job->pid), SIGCONT); // 给当前的进程组发送SIGCONT信号
+        signal_job(job, SIGCONT, 1); // 给当前的进程组发送SIGCONT信号
         fflush(stdout);
     }
     else {
         // 如果是fg命令，那么就把job的状态改为FG
-        job->state = FG;
+        setjobstate(job_list, job, FG);
         // 使用kill发送信号
-        Kill(-(job->pid), SIGCONT); // 给当前的进程组发送SIGCONT信号
+        signal_job(job, SIGCONT, 1); // 给当前的进程组发送SIGCONT信号
         fflush(stdout);
-        waitfg(job->pid);
+        pid = job->pid;
+        Sigprocmask(SIG_SETMASK, &mask_one, NULL);
+        waitfg(pid);
     }
+    Sigprocmask(SIG_SETMASK, &prev_all, NULL);
     return;
 }
 
@@ -1215,12 +4000,25 @@ int Dup2(int oldfd, int newfd)
 }
 
 /*
- * conduct_kill - 执行kill命令
- * 通过kill发送SIGTERM信号
+ * conduct_kill - 执行kill命令
+ * 通过kill发送SIGTERM信号。从查找作业到发出信号都屏蔽信号，
+ * 中间不能让sigchld_handler把作业删掉。
+ */
+void conduct_kill(char **argv) {
+    sigset_t mask_all, prev_all;
+
+    Sigfillset(&mask_all);
+    Sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+    kill_job(argv[1]);
+    Sigprocmask(SIG_SETMASK, &prev_all, NULL);
+}
+
+/*
+ * kill_job - conduct_kill的主体。%jid发给作业（组长已经回收的话发给还在
+ * 的下一个进程），pid发给这个PID本身，不一定是组长。
  */
-void conduct_kill(char **argv) {
+static void kill_job(char *id) {
     struct job_t *job;
-    char *id = argv[1]; // id是一个字符串，到底是JID还是PID
     if (id[0] == '%') {
         // JID
         if (id[1] == '-') {
@@ -1232,7 +4030,11 @@ void conduct_kill(char **argv) {
                 fflush(stdout);
                 return;
             }
-            Kill(-(job->pid), SIGTERM);
+            if (job->state == QUEUED) {
+                drop_queued(job);
+                return;
+            }
+            signal_job(job, SIGTERM, 1);
             fflush(stdout);
         }
         else {
@@ -1244,7 +4046,11 @@ void conduct_kill(char **argv) {
                 fflush(stdout);
                 return;
             }
-            Kill(job->pid, SIGTERM);
+            if (job->state == QUEUED) {
+                drop_queued(job);
+                return;
+            }
+            signal_job(job, SIGTERM, 0);
         }
     }
     else {
@@ -1258,19 +4064,769 @@ void conduct_kill(char **argv) {
                 fflush(stdout);
                 return;
             }
-            Kill(-(job->pid), SIGTERM);
+            signal_job(job, SIGTERM, 1);
         }
         else {
             // 要通过杀死pid为首的进程
             pid_t pid = atoi(id);
             job = getjobpid(job_list, pid);
-            if (job == NULL) {
+            if (job == NULL || signal_pid(job, pid, SIGTERM) < 0) {
                 printf("(%s): No such process\n", id);
                 fflush(stdout);
                 return;
             }
-            Kill(job->pid, SIGTERM);
+        }
+    }
+}
+
+/*
+ * conduct_setmax - 执行setmax命令。setmax N：最多同时运行N个后台作业，
+ * 多出来的排队（0表示不限制）；不带参数就打印当前的值。
+ */
+void conduct_setmax(char **argv) {
+    sigset_t mask_all, prev_all;
+    int n;
+
+    if (argv[1] == NULL) {
+        printf("setmax %d\n", job_list->maxrun);
+        fflush(stdout);
+        return;
+    }
+    if (!isdigit((unsigned char)argv[1][0]) || (n = atoi(argv[1])) < 0) {
+        printf("setmax: %s: invalid number\n", argv[1]);
+        fflush(stdout);
+        return;
+    }
+    Sigfillset(&mask_all);
+    Sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+    job_list->maxrun = n;
+    launch_queued(job_list);    // 限制放宽了，排队的作业可能可以启动了
+    Sigprocmask(SIG_SETMASK, &prev_all, NULL);
+}
+
+/*
+ * make_spec - 把tok里的命令（time前缀已经去掉）复制成一个launchspec_t，
+ * 命令名在这里就解析好。全部放在arena的一块里，失败返回NULL。
+ */
+struct launchspec_t *make_spec(struct cmdline_tokens *tok, struct jobprefix_t *pre, char *cmdline) {
+    struct launchspec_t *spec;
+    const char *path[MAXSTAGES];
+    size_t size;
+    char **argv, *p;
+    int i, j, nargs;
+
+    size = sizeof(*spec);
+    nargs = tok->argc - tok->stage[0] + 1;   // 包括命令之间的NULL和最后的NULL
+    size += nargs * sizeof(char *);
+    for (i = 0; i < tok->nstages; i++) {
+        if ((path[i] = resolve_cmd(tok->argv[tok->stage[i]])) == NULL) {
+            printf("%s: Command not found\n", tok->argv[tok->stage[i]]);
+            fflush(stdout);
+            return NULL;
+        }
+        size += strlen(path[i]) + 1;
+    }
+    for (j = tok->stage[0]; j < tok->argc; j++)
+        if (tok->argv[j] != NULL)
+            size += strlen(tok->argv[j]) + 1;
+    if (tok->infile != NULL)
+        size += strlen(tok->infile) + 1;
+    if (tok->outfile != NULL)
+        size += strlen(tok->outfile) + 1;
+    size += strlen(cmdline) + 1;
+
+    if ((spec = arena_alloc(&str_arena, size)) == NULL) {
+        printf("Error: command line too long to queue\n");
+        fflush(stdout);
+        return NULL;
+    }
+    argv = (char **)(spec + 1);
+    p = (char *)(argv + nargs);
+    spec->pre = *pre;
+    spec->pre.cpulist = NULL;   // 指向parseline的缓冲区，出队时早就没了
+    spec->nstages = tok->nstages;
+    for (i = 0; i < tok->nstages; i++) {
+        spec->path[i] = strcpy(p, path[i]);
+        p += strlen(p) + 1;
+        spec->argv[i] = &argv[tok->stage[i] - tok->stage[0]];
+    }
+    for (j = tok->stage[0]; j <= tok->argc; j++) {
+        if (j == tok->argc || tok->argv[j] == NULL) {
+            argv[j - tok->stage[0]] = NULL;
+            continue;
+        }
+        argv[j - tok->stage[0]] = strcpy(p, tok->argv[j]);
+        p += strlen(p) + 1;
+    }
+    spec->infile = spec->outfile = NULL;
+    if (tok->infile != NULL) {
+        spec->infile = strcpy(p, tok->infile);
+        p += strlen(p) + 1;
+    }
+    if (tok->outfile != NULL) {
+        spec->outfile = strcpy(p, tok->outfile);
+        p += strlen(p) + 1;
+    }
+    spec->cmdline = strcpy(p, cmdline);
+    return spec;
+}
+
+/*
+ * enqueue_job - 后台作业太多了，新的后台作业先排队：现在就分配作业记录
+ * 和JID，解析命令，并在PID索引里预留位置，出队时就不用再分配内存了。
+ */
+void enqueue_job(struct cmdline_tokens *tok, char *cmdline, struct jobprefix_t *pre, struct timespec *submit) {
+    struct launchspec_t *spec;
+    struct job_t *job;
+    sigset_t mask_all, prev_all;
+
+    Sigfillset(&mask_all);
+    Sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+    if ((spec = make_spec(tok, pre, cmdline)) == NULL) {
+        Sigprocmask(SIG_SETMASK, &prev_all, NULL);
+        return;
+    }
+    if ((job = newjob(job_list, QUEUED, cmdline)) == NULL) {
+        arena_free(&str_arena, spec);
+        Sigprocmask(SIG_SETMASK, &prev_all, NULL);
+        return;
+    }
+    job->spec = spec;
+    set_prefix(job, pre);
+    job->info->start = *submit;
+    jobidx_reserve(&job_list->pids, spec->nstages);
+    if (job_list->qtail != NULL)
+        job_list->qtail->qnext = job;
+    else
+        job_list->qhead = job;
+    job_list->qtail = job;
+
+    count_event(C_QUEUED);
+    log_event("queue", 0, job, NULL, 0);
+    printf("[%d] (queued) %s\n", job->jid, cmdline);
+    fflush(stdout);
+    launch_queued(job_list);    // 在检查和屏蔽信号之间可能已经空出位置了
+    Sigprocmask(SIG_SETMASK, &prev_all, NULL);
+}
+
+/* unqueue_job - 把job从队列里拿出来（调用者屏蔽了所有信号） */
+void unqueue_job(struct joblist_t *job_list, struct job_t *job) {
+    struct job_t **pp, *prev = NULL;
+
+    for (pp = &job_list->qhead; *pp != NULL; prev = *pp, pp = &(*pp)->qnext) {
+        if (*pp == job) {
+            *pp = job->qnext;
+            if (job_list->qtail == job)
+                job_list->qtail = prev;
+            job->qnext = NULL;
+            return;
+        }
+    }
+}
+
+/* drop_queued - kill一个还在排队的作业：直接从队列和作业表里删掉 */
+void drop_queued(struct job_t *job) {
+    sigset_t mask_all, prev_all;
+
+    Sigfillset(&mask_all);
+    Sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+    if (job->state == QUEUED) {     // 屏蔽信号之前可能已经出队了
+        printf("Job [%d] (queued) removed\n", job->jid);
+        fflush(stdout);
+        unqueue_job(job_list, job);
+        job->status = SIGTERM;      // 对wait来说就像被SIGTERM杀死了
+        freejob(job_list, job);
+    }
+    else
+        signal_job(job, SIGTERM, 1);
+    Sigprocmask(SIG_SETMASK, &prev_all, NULL);
+}
+
+/*
+ * start_job - 启动一个已经出队的作业，状态变为state，返回是否启动了。
+ *
+ * 可能在sigchld_handler里调用（屏蔽了所有信号），所以只用异步信号安全的
+ * 函数：用_Fork而不是fork（fork要拿malloc和stdio的锁，主程序可能正拿着，
+ * posix_spawn也一样），子进程里用sio输出错误；PID索引的位置在入队时预留
+ * 好了，不会分配内存。
+ */
+int start_job(struct joblist_t *job_list, struct job_t *job, int state) {
+    struct launchspec_t *spec = job->spec;
+    int i, fd, in = -1, out, pipe_fd[2];
+    pid_t pid, pgid = 0;
+    long forked = now_ns();
+
+    for (i = 0; i < spec->nstages; i++) {
+        out = -1;
+        if (i < spec->nstages - 1) {
+            if (pipe2(pipe_fd, O_CLOEXEC) < 0)
+                break;
+            out = pipe_fd[1];
+        }
+        if ((pid = _Fork()) == 0) {
+            sigprocmask(SIG_SETMASK, &child_mask, NULL);
+            setpgid(0, pgid);
+            if (apply_prefix(&spec->pre) < 0)
+                _exit(1);
+            if (i == 0 && spec->infile != NULL) {
+                if ((fd = open(spec->infile, O_RDONLY)) < 0) {
+                    sio_put("%s: No such file or directory\n", spec->infile);
+                    _exit(1);
+                }
+                in = fd;
+            }
+            if (i == spec->nstages - 1 && spec->outfile != NULL) {
+                if ((fd = open(spec->outfile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH)) < 0) {
+                    sio_put("%s: No such file or directory\n", spec->outfile);
+                    _exit(1);
+                }
+                out = fd;
+            }
+            if (in != -1)
+                dup2(in, STDIN_FILENO);
+            if (out != -1)
+                dup2(out, STDOUT_FILENO);
+            execve(spec->path[i], spec->argv[i], environ);
+            sio_put("%s: Command not found\n", spec->argv[i][0]);
+            _exit(1);
+        }
+        if (in != -1)
+            close(in);
+        if (out != -1)
+            close(out);
+        in = (i < spec->nstages - 1) ? pipe_fd[0] : -1;
+        if (pid < 0)
+            continue;
+        setpgid(pid, pgid ? pgid : pid);
+        if (pgid == 0)
+            pgid = pid;
+        job_list->pids.reserved--;  // 用掉预留的位置，jobidx_insert不会扩大索引
+        addjobpid(job_list, job, pid);
+        log_event("fork", pid, job, "stage", i);
+    }
+    if (in != -1)
+        close(in);
+
+    // 剩下的预留位置不要了
+    job_list->pids.reserved -= spec->nstages - job->nprocs;
+    if (pgid == 0) {
+        job->spec = NULL;
+        arena_free(&str_arena, spec);
+        freejob(job_list, job);
+        return 0;
+    }
+    setjobstate(job_list, job, state);
+    clock_gettime(CLOCK_MONOTONIC, &job->info->launched);
+    hist_add(H_LAUNCH, job->info->launched.tv_sec * 1000000000L + job->info->launched.tv_nsec - forked);
+    log_event("release", pgid, job, NULL, 0);
+    // 在后台启动的要告诉用户它的PID：spec交给通知，打印以后再释放
+    if (state == BG)
+        push_notice(NOTICE_START, job, 0, 0);
+    else
+        arena_free(&str_arena, spec);
+    job->spec = NULL;
+    return 1;
+}
+
+/*
+ * launch_queued - 只要运行中的后台作业少于maxrun，就按先来后到启动排队
+ * 的作业。在sigchld_handler里（作业结束或者停止以后）和屏蔽了所有信号的
+ * 主程序里调用。
+ */
+void launch_queued(struct joblist_t *job_list) {
+    struct job_t *job;
+
+    while ((job = job_list->qhead) != NULL
+           && (job_list->maxrun == 0 || job_list->running < job_list->maxrun)) {
+        unqueue_job(job_list, job);
+        start_job(job_list, job, BG);
+    }
+}
+
+/*
+ * wait_print - wait命令报告一个等到的作业。被信号杀死的作业
+ * child_changed已经打印过了，这里只报告正常退出的退出码。
+ */
+static void wait_print(struct waitres_t *res) {
+    if (res->status >= 0 && WIFEXITED(res->status)) {
+        printf("[%d] (%d) Exit %d\n", res->jid, res->pid, WEXITSTATUS(res->status));
+        fflush(stdout);
+    }
+}
+
+/*
+ * conduct_wait - 执行wait命令。
+ * wait             等所有后台作业（包括排队的）结束，停止的作业不等
+ * wait %jid pid .. 等这些作业结束，报告各自的退出码
+ * wait -n [ids]    等其中（不给就是任意一个后台作业）第一个结束的
+ * 和waitfg一样在wait_event里睡眠，不会忙等；没有前台作业时ctrl-c打断它。
+ */
+void conduct_wait(char **argv) {
+    struct waitres_t res[MAXARGS], any;
+    struct job_t *jobs[MAXARGS], *job;
+    sigset_t mask_one, prev_one;
+    int i, n = 0, first = 0, pending, slot;
+    char *id;
+
+    if (argv[1] != NULL && !strcmp(argv[1], "-n")) {
+        first = 1;
+        argv++;
+    }
+
+    Sigemptyset(&mask_one);
+    Sigaddset(&mask_one, SIGCHLD);
+    Sigprocmask(SIG_BLOCK, &mask_one, &prev_one);
+    interrupted = 0;
+    any.status = -1;
+
+    // wait或者wait -n：只看计数，不用给每个作业挂waiter
+    if (argv[1] == NULL) {
+        if (first) {
+            slot = 0;
+            while ((job = nextjob(job_list, &slot)) != NULL)
+                if (job->state == BG || job->state == QUEUED)
+                    job->waiter = &any;
+        }
+        while ((job_list->running > 0 || job_list->qhead != NULL)
+               && !(first && any.status >= 0) && !interrupted)
+            wait_event(0);
+        if (first) {
+            slot = 0;
+            while ((job = nextjob(job_list, &slot)) != NULL)
+                if (job->waiter == &any)
+                    job->waiter = NULL;
+            wait_print(&any);
+        }
+        Sigprocmask(SIG_SETMASK, &prev_one, NULL);
+        return;
+    }
+
+    for (i = 1; (id = argv[i]) != NULL && n < MAXARGS; i++) {
+        if (id[0] == '%') {
+            if ((job = getjobjid(job_list, atoi(id + 1))) == NULL) {
+                printf("%s: No such job\n", id);
+                fflush(stdout);
+                continue;
+            }
+        }
+        else if ((job = getjobpid(job_list, atoi(id))) == NULL) {
+            printf("(%s): No such process\n", id);
+            fflush(stdout);
+            continue;
+        }
+        if (job->waiter != NULL)    // 同一个作业写了两遍
+            continue;
+        res[n].status = -1;
+        job->waiter = first ? &any : &res[n];
+        jobs[n++] = job;
+    }
+
+    // 等待期间不会有新作业（排队的作业本来就有记录），jobs[i]一直有效，
+    // 直到freejob填好它的结果
+    while (!interrupted) {
+        pending = 0;
+        for (i = 0; i < n; i++) {
+            if (first ? any.status >= 0 : res[i].status >= 0)
+                continue;
+            if (jobs[i]->state != ST)
+                pending++;
+        }
+        if (pending == 0 || (first && any.status >= 0))
+            break;
+        wait_event(0);
+    }
+
+    for (i = 0; i < n; i++) {
+        if (first ? jobs[i]->waiter == &any : res[i].status < 0)
+            jobs[i]->waiter = NULL;     // 没等到（停止了或者被打断了）
+        else if (!first)
+            wait_print(&res[i]);
+    }
+    if (first)
+        wait_print(&any);
+    Sigprocmask(SIG_SETMASK, &prev_one, NULL);
+}
+
+/*
+ * parallel命令的模板：命令行拼成一个字符串，{}的位置记在hole里（字符串里
+ * 不包括{}本身）。raw为0的{}是单独一个参数，参数里有空格之类的要加引号；
+ * 在引号里面的{}原样替换。
+ */
+struct ptemplate_t {
+    char text[MAXLINE];
+    int len;
+    int nholes;
+    int hole[MAXARGS];
+    char raw[MAXARGS];
+};
+
+/* pquote - 参数需要加引号的话返回用哪个引号，否则返回0 */
+static char pquote(const char *arg) {
+    if (arg[0] != '\0' && strpbrk(arg, " \t<>|&'\"") == NULL)
+        return 0;
+    return strchr(arg, '"') != NULL ? '\'' : '"';
+}
+
+/* ptemplate_add - 把s追加到模板里，s里的{}记成hole，返回-1表示太长 */
+static int ptemplate_add(struct ptemplate_t *t, const char *s, int raw) {
+    while (*s != '\0') {
+        if (s[0] == '{' && s[1] == '}') {
+            if (t->nholes == MAXARGS)
+                return -1;
+            t->hole[t->nholes] = t->len;
+            t->raw[t->nholes++] = raw;
+            s += 2;
+            continue;
+        }
+        if (t->len + 1 >= MAXLINE)
+            return -1;
+        t->text[t->len++] = *s++;
+    }
+    t->text[t->len] = '\0';
+    return 0;
+}
+
+/* 
+ * ptemplate_init - 把parallel后面、:::前面的参数做成模板。这些参数指向
+ *     parseline的静态缓冲区，嵌套的eval会覆盖它，所以只在开始时看一次。
+ */
+static int ptemplate_init(struct ptemplate_t *t, char **argv) {
+    char q[2] = {0, 0};
+    int i;
+
+    t->len = 0;
+    t->nholes = 0;
+    t->text[0] = '\0';
+    for (i = 0; argv[i] != NULL; i++) {
+        if (i > 0 && ptemplate_add(t, " ", 1) < 0)
+            return -1;
+        if (!strcmp(argv[i], "{}")) {
+            if (ptemplate_add(t, "{}", 0) < 0)
+                return -1;
+        }
+        else if ((q[0] = pquote(argv[i])) != 0 || strstr(argv[i], "{}") != NULL) {
+            if (q[0] == 0)      // a{}b：整个词加引号，参数有空格也还是一个参数
+                q[0] = '"';
+            if (ptemplate_add(t, q, 1) < 0 || ptemplate_add(t, argv[i], 1) < 0
+                || ptemplate_add(t, q, 1) < 0)
+                return -1;
+        }
+        else if (ptemplate_add(t, argv[i], 1) < 0)
+            return -1;
+    }
+    if (t->nholes == 0)     // 没有{}就把参数放在最后
+        return ptemplate_add(t, " {}", 0);
+    return 0;
+}
+
+/* ptemplate_expand - 用arg填模板，生成后台作业的命令行，返回-1表示太长 */
+static int ptemplate_expand(struct ptemplate_t *t, const char *arg, char *line) {
+    int i, n = 0, from = 0, len = strlen(arg);
+    char q;
+
+    for (i = 0; i <= t->nholes; i++) {
+        int to = (i < t->nholes) ? t->hole[i] : t->len;
+        if (n + (to - from) + len + 4 >= MAXLINE)
+            return -1;
+        memcpy(line + n, t->text + from, to - from);
+        n += to - from;
+        from = to;
+        if (i == t->nholes)
+            break;
+        q = t->raw[i] ? 0 : pquote(arg);
+        if (q)
+            line[n++] = q;
+        memcpy(line + n, arg, len);
+        n += len;
+        if (q)
+            line[n++] = q;
+    }
+    strcpy(line + n, " &");
+    return 0;
+}
+
+/*
+ * parallel_reap - 处理parallel里已经结束的作业：打印退出码，空出位置。
+ *     停止的作业也不算在飞了，以免一个停止的作业卡住整个parallel。
+ */
+static int parallel_reap(struct waitres_t *res, struct job_t **jobs, int n) {
+    int i, inflight = 0;
+
+    for (i = 0; i < n; i++) {
+        if (jobs[i] == NULL)
+            continue;
+        if (res[i].status >= 0) {
+            wait_print(&res[i]);
+            jobs[i] = NULL;
+        }
+        else if (jobs[i]->state == ST) {
+            jobs[i]->waiter = NULL;
+            jobs[i] = NULL;
+        }
+        else
+            inflight++;
+    }
+    return inflight;
+}
+
+/*
+ * conduct_parallel - 执行parallel命令。
+ * parallel [-j N] cmd args... ::: arg1 arg2 ...
+ * parallel [-j N] cmd args... < file     file的每一行是一个参数
+ * 把模板里的{}换成参数（没有{}就加在最后），作为后台作业交给eval，同时
+ * 最多N个（默认是CPU个数），和wait一样报告每个作业的退出码。没有前台
+ * 作业时ctrl-c停止启动新的作业，已经启动的留在后台。
+ */
+void conduct_parallel(char **argv, struct cmdline_tokens *tok) {
+    struct ptemplate_t tmpl;
+    struct waitres_t *res;
+    struct job_t **jobs;
+    sigset_t mask_one, prev_one;
+    unsigned long serial;
+    char line[MAXLINE], *args = NULL, *arg = NULL, *p, *nl;
+    size_t size = 0;
+    FILE *fp = NULL;
+    int i, n, nargs = 0, max = 0, inflight = 0;
+
+    argv++;
+    if (argv[0] != NULL && !strncmp(argv[0], "-j", 2)) {
+        p = (argv[0][2] != '\0') ? argv[0] + 2 : *++argv;
+        if (p == NULL || (max = atoi(p)) <= 0) {
+            printf("parallel: -j needs a positive number\n");
+            fflush(stdout);
+            return;
+        }
+        argv++;
+    }
+    if (max == 0 && (max = sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+        max = 1;
+
+    for (n = 0; argv[n] != NULL && strcmp(argv[n], ":::"); n++)
+        ;
+    if (n == 0) {
+        printf("parallel: missing command\n");
+        fflush(stdout);
+        return;
+    }
+    if (argv[n] != NULL) {
+        // 参数也在parseline的缓冲区里，先复制一份
+        for (i = n + 1; argv[i] != NULL; i++)
+            size += strlen(argv[i]) + 1;
+        if ((args = malloc(size + 1)) == NULL)
+            unix_error("parallel: malloc error");
+        for (i = n + 1, p = args; argv[i] != NULL; i++, nargs++)
+            p = stpcpy(p, argv[i]) + 1;
+        argv[n] = NULL;
+        arg = args;
+    }
+    else if (tok->infile == NULL) {
+        printf("parallel: no arguments (use ::: or < file)\n");
+        fflush(stdout);
+        return;
+    }
+    else if ((fp = fopen(tok->infile, "r")) == NULL) {
+        printf("%s: No such file or directory\n", tok->infile);
+        fflush(stdout);
+        return;
+    }
+    if (ptemplate_init(&tmpl, argv) < 0) {
+        printf("parallel: command too long\n");
+        fflush(stdout);
+        goto out;
+    }
+
+    if ((res = malloc(max * sizeof(*res))) == NULL
+        || (jobs = calloc(max, sizeof(*jobs))) == NULL)
+        unix_error("parallel: malloc error");
+
+    // 和wait一样屏蔽着SIGCHLD，eval返回之前新作业不会被回收，能挂上waiter
+    Sigemptyset(&mask_one);
+    Sigaddset(&mask_one, SIGCHLD);
+    Sigprocmask(SIG_BLOCK, &mask_one, &prev_one);
+    interrupted = 0;
+    while (!interrupted) {
+        while (inflight == max && !interrupted) {
+            wait_event(0);
+            inflight = parallel_reap(res, jobs, max);
+        }
+        if (interrupted)
+            break;
+
+        // 下一个参数
+        if (fp != NULL) {
+            if (getline(&arg, &size, fp) < 0)
+                break;
+            if ((nl = strchr(arg, '\n')) != NULL)
+                *nl = '\0';
+        }
+        else if (nargs-- == 0)
+            break;
+
+        if (ptemplate_expand(&tmpl, arg, line) < 0) {
+            printf("parallel: command too long for argument %s\n", arg);
             fflush(stdout);
         }
+        else {
+            serial = job_list->serial;
+            eval(line);
+            if (job_list->serial != serial) {
+                for (i = 0; jobs[i] != NULL; i++)
+                    ;
+                if ((jobs[i] = getjobjid(job_list, job_list->newest)) != NULL) {
+                    res[i].status = -1;
+                    jobs[i]->waiter = &res[i];
+                }
+            }
+            inflight = parallel_reap(res, jobs, max);
+        }
+        if (fp == NULL)
+            arg += strlen(arg) + 1;
+    }
+    while (inflight > 0 && !interrupted) {
+        wait_event(0);
+        inflight = parallel_reap(res, jobs, max);
+    }
+    for (i = 0; i < max; i++)    // 被打断了，剩下的作业不等了
+        if (jobs[i] != NULL)
+            jobs[i]->waiter = NULL;
+    Sigprocmask(SIG_SETMASK, &prev_one, NULL);
+    free(res);
+    free(jobs);
+
+out:
+    if (fp != NULL) {
+        free(arg);
+        fclose(fp);
+    }
+    free(args);
+}
+
+/* now_ns - CLOCK_MONOTONIC in nanoseconds (async-signal-safe) */
+long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* hist_add - 往直方图h里加一个样本（异步信号安全） */
+void hist_add(int h, long ns) {
+    struct hist_t *hist = &hists[h];
+    unsigned long v = (ns > 0) ? (unsigned long)ns : 0, max;
+    int b = (v > 1) ? 63 - __builtin_clzl(v) : 0;
+
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum, v, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->bucket[b], 1, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    while (v > max && !__atomic_compare_exchange_n(&hist->max, &max, v, 0,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/* count_event - 计数器c加一（异步信号安全） */
+void count_event(int c) {
+    __atomic_fetch_add(&counters[c], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * hist_pct - 直方图的第pct百分位数：落在哪个桶就报告那个桶的上界，
+ *     不超过最大值。没有样本返回0。
+ */
+static unsigned long hist_pct(const struct hist_t *hist, int pct) {
+    unsigned long want, seen = 0;
+    int b;
+
+    if (hist->count == 0)
+        return 0;
+    want = (hist->count * pct + 99) / 100;
+    for (b = 0; b < HISTBUCKETS; b++) {
+        if ((seen += hist->bucket[b]) >= want)
+            break;
+    }
+    if (b >= 63 || (2UL << b) - 1 > hist->max)
+        return hist->max;
+    return (2UL << b) - 1;
+}
+
+/* fmt_ns - 把纳秒数写成好读的形式（ns、us、ms或s） */
+static char *fmt_ns(char *buf, unsigned long ns) {
+    if (ns < 1000)
+        sprintf(buf, "%luns", ns);
+    else if (ns < 1000000)
+        sprintf(buf, "%.1fus", ns / 1e3);
+    else if (ns < 1000000000)
+        sprintf(buf, "%.1fms", ns / 1e6);
+    else
+        sprintf(buf, "%.2fs", ns / 1e9);
+    return buf;
+}
+
+/*
+ * conduct_stats - 执行stats命令：打印计数器和各个延迟直方图的
+ * 样本数、平均值、p50、p99和最大值。stats --json打印成一个JSON对象，
+ * 直方图里再加上非空的桶（[桶的上界, 个数]）。
+ */
+void conduct_stats(char **argv) {
+    int json = (argv[1] != NULL && !strcmp(argv[1], "--json"));
+
+    if (argv[1] != NULL && !json)
+        printf("stats: usage: stats [--json]\n");
+    else {
+        print_stats(stdout, json);
+        if (json)
+            printf("\n");
+    }
+    fflush(stdout);
+}
+
+/* print_stats - 把统计数据写到fp，控制socket的stats请求也用它 */
+void print_stats(FILE *fp, int json) {
+    struct hist_t snap[NHISTS], *h;
+    unsigned long cnt[NCOUNTERS];
+    char a[32], b[32], c[32], d[32];
+    int i, j, first;
+
+    // 拷一份再打印；信号处理程序随时可能在更新，拷贝的时候屏蔽它们
+    sigset_t mask_all, prev_all;
+    Sigfillset(&mask_all);
+    Sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+    memcpy(snap, hists, sizeof(snap));
+    memcpy(cnt, counters, sizeof(cnt));
+    Sigprocmask(SIG_SETMASK, &prev_all, NULL);
+
+    if (json) {
+        fprintf(fp, "{\"counters\":{");
+        for (i = 0; i < NCOUNTERS; i++)
+            fprintf(fp, "%s\"%s\":%lu", i ? "," : "", counter_names[i], cnt[i]);
+        fprintf(fp, "},\"histograms\":{");
+        for (i = 0; i < NHISTS; i++) {
+            h = &snap[i];
+            fprintf(fp, "%s\"%s\":{\"count\":%lu,\"sum_ns\":%lu,\"max_ns\":%lu,"
+                   "\"p50_ns\":%lu,\"p99_ns\":%lu,\"buckets\":[",
+                   i ? "," : "", h->name, h->count, h->sum, h->max,
+                   hist_pct(h, 50), hist_pct(h, 99));
+            for (j = 0, first = 1; j < HISTBUCKETS; j++) {
+                if (h->bucket[j] == 0)
+                    continue;
+                fprintf(fp, "%s[%lu,%lu]", first ? "" : ",",
+                       j == 63 ? ~0UL : (2UL << j) - 1, h->bucket[j]);
+                first = 0;
+            }
+            fprintf(fp, "]}");
+        }
+        fprintf(fp, "}}");     // 不带换行，控制socket还要把它包起来
+        return;
+    }
+
+    for (i = 0; i < NCOUNTERS; i++)
+        fprintf(fp, "%s%s %lu", i ? "  " : "", counter_names[i], cnt[i]);
+    fprintf(fp, "\n");
+    fprintf(fp, "%-14s %8s %10s %10s %10s %10s\n", "latency", "count", "mean", "p50", "p99", "max");
+    for (i = 0; i < NHISTS; i++) {
+        h = &snap[i];
+        fprintf(fp, "%-14s %8lu %10s %10s %10s %10s\n", h->name, h->count,
+               fmt_ns(a, h->count ? h->sum / h->count : 0), fmt_ns(b, hist_pct(h, 50)),
+               fmt_ns(c, hist_pct(h, 99)), fmt_ns(d, h->max));
     }
 }